@@ -1,4 +1,4 @@
-// Bit-banged implementation without any use of interrupts.
+// Bit-banged implementation, optionally stepped by timer interrupts.
 // Data pin must have external 1K pull-up resistor.
 // Operates data pin as open-collector output.
 
@@ -8,6 +8,7 @@
 	#include "config.h"
 #endif
 
+#include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
@@ -39,11 +40,61 @@ enum { data_mask = 1<<ADB_DATA_BIT };
 	enum { adb_cell_time = 100 };
 #endif
 
+// ATmega88 and similar
+#ifndef TCCR0
+	#define TCCR0 TCCR0B
+#endif
+
 // gcc is very unreliable for inlining, so use macros
 #define data_lo() (ADB_DDR |=  data_mask)
 #define data_hi() (ADB_DDR &= ~data_mask)
 #define data_in() (ADB_PIN &   data_mask)
 
+// Waits while data == val, or until us timeout expires. Returns remaining time,
+// zero if timed out.
+static byte while_data( byte us, byte data )
+{
+	while ( data_in() == data )
+	{
+		delay_loop_usec( 1 /* us period */, 7 /* cycles loop overhead */ );
+		if ( !--us )
+			break;
+	}
+	return us;
+}
+
+static byte while_lo( byte us ) { return while_data( us, 0 ); }
+static byte while_hi( byte us ) { return while_data( us, data_mask ); }
+
+// Set if device requested service during last command
+static volatile bool srq;
+
+bool adb_host_srq( void )
+{
+	return srq;
+}
+
+// Set if another device drove data low while we were sending listen data
+static volatile bool collided;
+
+// Address of device last sent a command, whose timing is used to receive
+static byte cur_addr;
+
+adb_host_stats_t adb_host_stats;
+
+// Increments counter unless it's already at maximum
+static void stats_inc( uint16_t* n )
+{
+	if ( *n != 0xFFFF )
+		++*n;
+}
+
+static void stats_irq_off( uint16_t us )
+{
+	if ( adb_host_stats.max_irq_off < us )
+		adb_host_stats.max_irq_off = us;
+}
+
 static void place_bit( byte bit )
 {
 	data_lo();
@@ -56,6 +107,9 @@ static void place_bit( byte bit )
 	
 	data_hi();
 	_delay_us( adb_cell_time/3 );
+	
+	if ( !data_in() )
+		collided = true;
 }
 
 static void place_bit0( void ) { place_bit( 0 ); }
@@ -71,15 +125,28 @@ static void send_byte( byte data )
 	}
 }
 
-static void command( byte cmd )
+// Sends command and returns time it took, in microseconds
+static uint16_t command( byte cmd )
 {
+	cur_addr = cmd >> 4;
 	data_lo();
 	_delay_us( adb_cell_time*8 );
 	place_bit1();
 	send_byte( cmd );
 	place_bit0();
+	
+	uint16_t time = adb_cell_time * (8 + 10);
+	
+	// Device requesting service holds stop bit low for up to 300us
+	srq = !data_in();
+	if ( srq )
+		time += 255 - while_lo( 255 );
+	
+	return time;
 }
 
+static void timing_reset( void );
+
 void adb_host_init( void )
 {
 	// Always keep port output 0, then just toggle DDR to be GND or leave it floating (high).
@@ -87,6 +154,11 @@ void adb_host_init( void )
 	ADB_DDR	 &= ~data_mask;
 	ADB_PORT &= ~data_mask;
 	
+	// Free-running time base for capture()
+	TCCR0 = 2<<CS00;
+	
+	timing_reset();
+	
 	#ifdef ADB_PSW_BIT
 		// Weak pull-up
 		ADB_PORT |=  (1<<ADB_PSW_BIT);
@@ -103,87 +175,640 @@ bool adb_host_psw( void )
 	#endif
 }
 
-// Waits while data == val, or until us timeout expires. Returns remaining time,
-// zero if timed out.
-static byte while_data( byte us, byte data )
+#ifdef ADB_PSW_BIT
+
+// Power switch must be on INT1, the only external interrupt that can wake
+// ATmega8 from sleep other than V-USB's INT0
+#if ADB_PSW_BIT != 3 || !ADB_ON_PORTD
+	#error "ADB_PSW_BIT must be 3 (PD3/INT1), with ADB on PORTD (ADB_ON_PORTD)"
+#endif
+
+// INT1 mask, flag, and sense control registers
+#ifdef GICR
+	#define PSW_IMSK GICR
+	#define PSW_IFR  GIFR
+	#define PSW_ICR  MCUCR
+#else
+	// ATmega88 and similar
+	#define PSW_IMSK EIMSK
+	#define PSW_IFR  EIFR
+	#define PSW_ICR  EICRA
+#endif
+
+static volatile bool psw_woke;
+
+// Low level is the only INT1 mode that wakes from every sleep mode. It keeps
+// firing while switch is held, so it disables itself before interrupts are
+// enabled again. It's short enough not to delay V-USB's interrupt.
+ISR(INT1_vect)
 {
-	while ( data_in() == data )
+	PSW_IMSK &= ~(1<<INT1);
+	psw_woke = true;
+}
+
+#endif
+
+bool adb_host_psw_wake( bool enable )
+{
+	#ifdef ADB_PSW_BIT
+		PSW_IMSK &= ~(1<<INT1);
+		bool woke = psw_woke;
+		psw_woke = false;
+		if ( enable )
+		{
+			PSW_ICR &= ~(1<<ISC11 | 1<<ISC10);
+			PSW_IFR = 1<<INTF1;
+			PSW_IMSK |= 1<<INT1;
+		}
+		return woke;
+	#else
+		(void) enable;
+		return false;
+	#endif
+}
+
+// Device's response is captured as edge times with interrupts disabled, then
+// decoded into bits afterwards, so the timing-critical loop does as little as
+// possible.
+
+// Timer0 ticks (F_CPU/8) for given time, and the reverse
+#define usec_to_tcnt0( us ) ((us) * (F_CPU / 8) / 1000000)
+#define tcnt0_to_usec( t )  ((uint16_t) ((uint32_t) (t) * 8000 / (F_CPU / 1000)))
+
+enum { max_bit_time = 130 }; // maximum low or high time within bit cell
+enum { capture_timeout = usec_to_tcnt0( max_bit_time ) > 255 ? 255 :
+		usec_to_tcnt0( max_bit_time ) };
+enum { glitch_time = usec_to_tcnt0( 8 ) }; // shorter pulses are noise
+
+// Edges for start bit and len data bytes, then fall of stop bit. Capture
+// ends there rather than waiting out the stop bit.
+#define edges_for( len ) ((1 + (len) * 8) * 2 + 1)
+
+// Per-device timing learned by adb_host_calibrate(). Split is low time that
+// divides 1 bits from 0 bits, in 1/256 of bit cell. Timeout is longest low or
+// high time within a bit cell, plus margin, in TCNT0 ticks.
+enum { default_split = 128 };
+static byte timing_split   [16];
+static byte timing_timeout [16];
+
+static void timing_reset( void )
+{
+	memset( timing_split,   default_split,   sizeof timing_split );
+	memset( timing_timeout, capture_timeout, sizeof timing_timeout );
+}
+
+enum { max_bytes = 8 };
+static byte edges [edges_for( max_bytes ) + 2]; // room for a glitch
+static byte edge_count;
+static byte capture_wait;   // microseconds before response began
+
+// How capture ended
+enum { end_full, end_low_timeout, end_high_timeout };
+static byte capture_end;
+
+// Waits up to us for device to begin response, then records TCNT0 at each
+// edge until max edges (plus two for a glitch) or data stops changing.
+// Returns false if no response.
+static bool capture( byte us, byte max )
+{
+	edge_count = 0;
+	capture_end = end_full;
+	capture_wait = us - while_hi( us );
+	if ( capture_wait == us )
+		return false;
+	
+	byte timeout = timing_timeout [cur_addr];
+	byte glitches = 1;
+	byte* p = edges;
+	byte* end = edges + max;
+	byte level = 0;
+	byte prev = TCNT0;
+	*p++ = prev;
+	do
 	{
-		delay_loop_usec( 1 /* us period */, 7 /* cycles loop overhead */ );
-		if ( !--us )
+		byte time = TCNT0;
+		if ( data_in() != level )
+		{
+			level ^= data_mask;
+			*p++ = time;
+			
+			// decode() skips one glitch, so make room for it
+			if ( (byte) (time - prev) < glitch_time && glitches )
+			{
+				glitches = 0;
+				end += 2;
+			}
+			prev = time;
+		}
+		else if ( (byte) (time - prev) > timeout )
+		{
+			capture_end = level ? end_high_timeout : end_low_timeout;
 			break;
+		}
 	}
-	return us;
+	while ( p != end );
+	
+	edge_count = p - edges;
+	return true;
 }
 
-static byte while_lo( byte us ) { return while_data( us, 0 ); }
-static byte while_hi( byte us ) { return while_data( us, data_mask ); }
+// Time interrupts were disabled by last capture, in microseconds
+static uint16_t capture_time( void )
+{
+	uint16_t ticks = 0;
+	if ( edge_count )
+	{
+		byte i;
+		for ( i = 1; i < edge_count; i++ )
+			ticks += (byte) (edges [i] - edges [i - 1]);
+		
+		if ( capture_end != end_full )
+			ticks += timing_timeout [cur_addr];
+	}
+	return capture_wait + tcnt0_to_usec( ticks );
+}
 
-uint16_t adb_host_talk( uint8_t cmd )
+// Converts captured edges into up to len bytes. Returns number of bytes, or 0
+// if start bit is wrong or there wasn't even one byte. Doesn't need interrupts
+// disabled.
+static byte decode( byte* out, byte len )
 {
-	command( cmd );
-	_delay_us( 5 );
-	if ( !while_hi( 260 - 5 ) ) // avg 160
-		return adb_host_nothing;
+	// Skip one glitch, a pulse too short to be real
+	byte n = edge_count;
+	byte glitch = n;
+	byte i;
+	for ( i = 1; i < n; i++ )
+	{
+		if ( (byte) (edges [i] - edges [i - 1]) < glitch_time )
+		{
+			glitch = i - 1;
+			n -= 2;
+			break;
+		}
+	}
+	#define EDGE( k ) edges [(k) < glitch ? (k) : (k) + 2]
 	
-	// Receive start bit and 16 data bits.
-	// Doing them all in loop allows consistent error checking
-	uint16_t data = 0;
-	byte n = 17;
-	do
+	// Need fall and rise of every bit. Last bit's cell time may be missing
+	// if a glitch was skipped, so previous one is used.
+	#ifdef ADB_REDUCED_TIME
+		byte cells = n / 2;
+	#else
+		byte cells = (n - 1) / 2; // stop bit must also begin
+	#endif
+	if ( !cells )
+		return 0;
+	
+	byte count = (cells - 1) / 8;
+	if ( count > len )
+		count = len;
+	
+	uint16_t split = timing_split [cur_addr];
+	byte data = 0;
+	byte cell = 0;
+	byte k = 0; // edge at beginning of cell
+	for ( i = 0; i <= count * 8; i++, k += 2 )
 	{
-		data <<= 1;
-		enum { timeout = 130 }; // maximum bit cell time
+		byte lo = EDGE( k + 1 ) - EDGE( k );
+		if ( k + 2 < n )
+			cell = EDGE( k + 2 ) - EDGE( k );
 		
-		byte lo = while_lo( timeout );
-		if ( !lo )
-			goto error; // timeout
+		data = data << 1 | ((uint16_t) lo << 8 < split * cell);
+		if ( !i )
+		{
+			if ( !data )
+				return 0; // start bit is wrong
+			data = 0;
+		}
+		else if ( !(i & 7) )
+		{
+			*out++ = data;
+		}
+	}
+	#undef EDGE
+	
+	return count;
+}
+
+// Decodes captured two-byte response and counts result
+static uint16_t decode_word( void )
+{
+	if ( !edge_count )
+	{
+		stats_inc( &adb_host_stats.no_response );
+		return adb_host_nothing;
+	}
+	
+	byte data [2];
+	if ( decode( data, 2 ) != 2 )
+	{
+		if ( capture_end == end_low_timeout )
+			stats_inc( &adb_host_stats.low_timeout );
+		else if ( capture_end == end_high_timeout )
+			stats_inc( &adb_host_stats.high_timeout );
+		else
+			stats_inc( &adb_host_stats.bad_start );
+		return adb_host_error;
+	}
+	
+	stats_inc( &adb_host_stats.ok );
+	return data [0] << 8 | data [1];
+}
+
+// Refines timing of current device from captured response that decoded to
+// data, moving halfway from old values to measured ones
+static void learn_timing( uint16_t data )
+{
+	if ( edge_count != edges_for( 2 ) )
+		return; // glitch or truncated
+	
+	uint16_t sum [2] = { 0, 0 }; // low times in 1/256 of cell, for 0 and 1 bits
+	byte count [2] = { 0, 0 };
+	byte longest = 0;
+	byte k;
+	for ( k = 2; k + 2 < edges_for( 2 ); k += 2, data <<= 1 )
+	{
+		byte lo   = edges [k + 1] - edges [k];
+		byte cell = edges [k + 2] - edges [k];
+		if ( lo >= cell )
+			return;
 		
-		byte hi = while_hi( lo );
-		if ( !hi )
-			goto error; // timeout
+		if ( longest < lo )
+			longest = lo;
+		if ( longest < cell - lo )
+			longest = cell - lo;
 		
-		if ( timeout-lo < lo-hi )
-			data |= 1;
-		else if ( n == 17 )
-			goto error; // start bit is wrong
+		byte bit = data >> 15;
+		sum   [bit] += ((uint16_t) lo << 8) / cell;
+		count [bit]++;
 	}
-	while ( --n );
 	
-	#ifndef ADB_REDUCED_TIME
-		// duration must be split in two due to 255 limit
-		if ( !while_lo( 255 ) && !while_lo( 351 - 255 ) )
-			goto error;
+	byte* split = &timing_split [cur_addr];
+	if ( count [0] && count [1] )
+		*split = (*split + (sum [0] / count [0] + sum [1] / count [1]) / 2) / 2;
 	
-		if ( while_hi( 91 ) )
-			goto error;
-	#endif
+	uint16_t timeout = longest + longest / 4 + glitch_time;
+	if ( timeout > capture_timeout )
+		timeout = capture_timeout;
+	byte* t = &timing_timeout [cur_addr];
+	*t = (*t + timeout) / 2;
+}
+
+bool adb_host_calibrate( uint8_t addr )
+{
+	static byte handlers [16]; // from previous calibration
+	
+	uint16_t r = adb_host_talk( adb_cmd_talk( addr, 3 ) );
+	if ( r == adb_host_nothing || r == adb_host_error )
+		return false;
 	
-	return data;
+	// Handler ID must match previous one, verifying that response was decoded
+	// properly. Address field can't be used since devices randomize it.
+	byte* handler = &handlers [addr];
+	if ( *handler != (r & 0xFF) )
+	{
+		*handler = r & 0xFF;
+		return false;
+	}
 	
-error:
-	return adb_host_error;
+	learn_timing( r );
+	return true;
 }
 
-uint16_t adb_host_kbd_recv( void )
+uint8_t adb_host_edges( uint8_t const** out )
 {
-	return adb_host_talk( adb_cmd_read + 0 );
+	*out = edges;
+	return edge_count;
 }
 
-uint16_t adb_host_kbd_modifiers( void )
+#if !ADB_TIMER_ENGINE
+
+uint16_t adb_host_talk( uint8_t cmd )
 {
-	return adb_host_talk( adb_cmd_read + 2 );
+	byte sreg = SREG;
+	cli(); // don't let anything upset ADB timing
+	uint16_t time = command( cmd );
+	_delay_us( 5 );
+	capture( 260 - 5, edges_for( 2 ) ); // avg 160
+	SREG = sreg;
+	
+	stats_irq_off( time + 5 + capture_time() );
+	return decode_word();
 }
 
-void adb_host_listen( byte cmd, byte data_h, byte data_l )
+bool adb_host_listen( byte cmd, byte data_h, byte data_l )
 {
-	command( cmd );
+	byte sreg = SREG;
+	cli();
+	uint16_t time = command( cmd );
 	_delay_us( adb_cell_time*2 );
 	
+	collided = false;
 	place_bit1();
 	send_byte( data_h ); 
 	send_byte( data_l );
 	place_bit0();
+	SREG = sreg;
+	
+	stats_irq_off( time + adb_cell_time * (2 + 18) );
+	return !collided;
+}
+
+#else
+
+// Runs transaction as a series of Timer2 compare interrupts, one per third of
+// a bit cell, so V-USB's interrupt can run between them. Only the device's
+// response is received with interrupts disabled, since it won't wait for us.
+
+#ifdef TCCR2
+	#define timer2_run()    (TCCR2 = 1<<WGM21 | 2<<CS20) // CTC, 8 prescaler
+	#define timer2_stop()   (TCCR2 = 0)
+	#define TIFR2           TIFR
+	#define TIMSK2          TIMSK
+#else
+	// ATmega88 and similar
+	#define timer2_run()    (TCCR2A = 1<<WGM21, TCCR2B = 2<<CS20)
+	#define timer2_stop()   (TCCR2B = 0)
+	#define OCR2            OCR2A
+	#define OCF2            OCF2A
+	#define OCIE2           OCIE2A
+	#define TIMER2_COMP_vect TIMER2_COMPA_vect
+#endif
+
+// Timer2 period for given time. Must fit in 8 bits.
+#define usec_to_ticks( us ) ((byte) ((us) * (F_CPU / 8) / 1000000 - 1))
+
+enum { third_ticks = usec_to_ticks( adb_cell_time/3 ) };
+enum { cell_ticks  = usec_to_ticks( adb_cell_time ) };
+
+// A step this late has stretched the level before it enough that device might
+// misread the bit, e.g. a 1 bit's low time passing half a cell
+enum { late_ticks  = usec_to_ticks( 10 ) };
+
+enum {
+	eng_idle,
+	eng_attention,  // holding data low for attention
+	eng_frame,      // sending start bit, data bits, stop bit
+	eng_srq,        // waiting for device to end service request
+	eng_gap,        // stop-to-start time before listen data
+	eng_tlt         // waiting for device to begin talk response
+};
+
+static volatile byte eng_state;
+static byte eng_count;          // attention cells, frame cells, or gap thirds left
+static byte eng_third;          // next third of current bit cell
+static byte eng_start;          // nonzero if next bit is start bit
+static byte eng_bit;            // value of current bit
+static byte eng_next;           // eng_gap or eng_tlt after command, eng_idle after data
+static uint16_t eng_shift;      // bits of frame, MSB first
+static uint16_t eng_out;        // data for listen
+static volatile uint16_t eng_result;
+static volatile bool eng_captured; // response needs decoding
+
+static void eng_finish( uint16_t result )
+{
+	timer2_stop();
+	TIFR2 = 1<<OCF2;
+	data_hi();
+	eng_result = result;
+	eng_state  = eng_idle;
+}
+
+static void eng_cell_start( void )
+{
+	data_lo();
+	
+	// Stop bit is 0 since all data bits have been shifted out by then
+	eng_bit = eng_start | (eng_shift >> 8 & 0x80);
+	if ( !eng_start )
+		eng_shift <<= 1;
+	eng_start = 0;
+	eng_third = 1;
+}
+
+// Proceeds to Tlt or listen data after command
+static void eng_end_command( void )
+{
+	eng_state = eng_next;
+	eng_next  = eng_idle;
+	eng_count = 6; // stop-to-start time of two cells before listen data
+	OCR2 = (eng_state == eng_tlt) ? cell_ticks : third_ticks;
+}
+
+static void eng_begin_frame( byte bits )
+{
+	eng_state = eng_frame;
+	eng_count = bits + 2;
+	eng_start = 1;
+	OCR2 = third_ticks;
+	eng_cell_start();
+}
+
+// Called at end of each timer period
+static void engine_step( void )
+{
+	switch ( eng_state )
+	{
+	case eng_attention:
+		// Data stays low into first third of start bit
+		if ( !--eng_count )
+			eng_begin_frame( 8 );
+		break;
+	
+	case eng_frame:
+		if ( eng_third == 1 )
+		{
+			// Difference between a 0 and 1 bit is just this third in the middle
+			if ( eng_bit )
+				data_hi();
+			eng_third = 2;
+		}
+		else if ( eng_third == 2 )
+		{
+			data_hi();
+			eng_third = 0;
+		}
+		else
+		{
+			if ( eng_next == eng_idle && !data_in() )
+				collided = true;
+			
+			if ( --eng_count )
+				eng_cell_start();
+			else if ( eng_next == eng_idle )
+				eng_finish( collided ? adb_host_error : 0 ); // listen data sent
+			else if ( data_in() )
+			{
+				srq = false;
+				eng_end_command();
+			}
+			else
+			{
+				srq = true;
+				eng_state = eng_srq;
+				eng_count = 300 / (adb_cell_time/3) + 1;
+			}
+		}
+		break;
+	
+	case eng_srq:
+		// Device requesting service holds stop bit low for up to 300us
+		if ( data_in() )
+			eng_end_command();
+		else if ( !--eng_count )
+			eng_finish( adb_host_error );
+		break;
+	
+	case eng_gap:
+		if ( !--eng_count )
+		{
+			eng_shift = eng_out;
+			eng_begin_frame( 16 );
+		}
+		break;
+	
+	case eng_tlt:
+	{
+		// One cell of Tlt has passed
+		byte sreg = SREG;
+		cli();
+		eng_captured = capture( 260 - adb_cell_time, edges_for( 2 ) );
+		SREG = sreg;
+		
+		stats_irq_off( capture_time() );
+		eng_finish( adb_host_nothing );
+		break;
+	}
+	
+	default:
+		eng_finish( adb_host_nothing );
+		break;
+	}
+}
+
+// V-USB requires that other interrupts not delay its own
+ISR(TIMER2_COMP_vect, ISR_NOBLOCK)
+{
+	// Keep from being re-entered if USB interrupt delays us
+	TIMSK2 &= ~(1<<OCIE2);
+	
+	// Timer counts up from compare point, so it tells how late we are.
+	// Timing is ruined if we're late or missed the next step.
+	if ( TCNT2 > late_ticks || (TIFR2 & (1<<OCF2)) )
+		eng_finish( adb_host_error );
+	else
+		engine_step();
+	
+	if ( eng_state != eng_idle && (TIFR2 & (1<<OCF2)) )
+		eng_finish( adb_host_error );
+	
+	TIMSK2 |= 1<<OCIE2;
+}
+
+// Waits for transaction to finish. Runs it without interrupts if they're disabled.
+static void engine_wait( void )
+{
+	while ( eng_state != eng_idle )
+	{
+		if ( !(SREG & (1<<SREG_I)) && (TIFR2 & (1<<OCF2)) )
+		{
+			TIFR2 = 1<<OCF2;
+			engine_step();
+		}
+	}
+}
+
+static void engine_start( byte cmd, byte next )
+{
+	engine_wait();
+	
+	cur_addr  = cmd >> 4;
+	eng_shift = (uint16_t) cmd << 8;
+	eng_next  = next;
+	eng_captured = false;
+	collided  = false;
+	eng_count = 8; // attention is eight cells
+	eng_state = eng_attention;
+	
+	data_lo();
+	TCNT2 = 0;
+	OCR2  = cell_ticks;
+	TIFR2 = 1<<OCF2;
+	TIMSK2 |= 1<<OCIE2;
+	timer2_run();
+}
+
+bool adb_host_busy( void )
+{
+	return eng_state != eng_idle;
+}
+
+uint16_t adb_host_result( void )
+{
+	if ( eng_captured )
+	{
+		eng_captured = false;
+		eng_result = decode_word();
+	}
+	return eng_result;
+}
+
+void adb_host_talk_start( uint8_t cmd )
+{
+	engine_start( cmd, eng_tlt );
+}
+
+void adb_host_listen_start( uint8_t cmd, uint8_t data_h, uint8_t data_l )
+{
+	engine_start( cmd, eng_gap );
+	
+	// Previous transaction was using eng_out until engine_start() returned
+	eng_out = (uint16_t) data_h << 8 | data_l;
+}
+
+uint16_t adb_host_talk( uint8_t cmd )
+{
+	adb_host_talk_start( cmd );
+	engine_wait();
+	return adb_host_result();
+}
+
+bool adb_host_listen( byte cmd, byte data_h, byte data_l )
+{
+	adb_host_listen_start( cmd, data_h, data_l );
+	engine_wait();
+	return adb_host_result() != adb_host_error;
+}
+
+#endif
+
+uint8_t adb_host_talk_buf( uint8_t cmd, uint8_t* out, uint8_t len )
+{
+	#if ADB_TIMER_ENGINE
+		engine_wait();
+	#endif
+	
+	if ( len > max_bytes )
+		len = max_bytes;
+	
+	byte sreg = SREG;
+	cli();
+	uint16_t time = command( cmd );
+	_delay_us( 5 );
+	capture( 260 - 5, edges_for( len ) );
+	SREG = sreg;
+	
+	stats_irq_off( time + 5 + capture_time() );
+	return decode( out, len );
+}
+
+uint16_t adb_host_kbd_recv( void )
+{
+	return adb_host_talk( adb_cmd_read + 0 );
+}
+
+uint16_t adb_host_kbd_modifiers( void )
+{
+	return adb_host_talk( adb_cmd_read + 2 );
 }
 
 void adb_host_kbd_led( byte led )
@@ -21,20 +21,79 @@ uint16_t adb_host_kbd_recv( void );
 // Returns adb_host_error if error receiving.
 uint16_t adb_host_kbd_modifiers( void );
 
-// Sends command and two bytes of data to keyboard
+// Talk and listen commands for register reg of device at ADB address addr
+#define adb_cmd_talk( addr, reg )   ((addr) << 4 | 0x0C | (reg))
+#define adb_cmd_listen( addr, reg ) ((addr) << 4 | 0x08 | (reg))
+
+// Sends command and two bytes of data to keyboard. Returns false if another
+// device drove data low while we were sending it (collision), or with
+// ADB_TIMER_ENGINE, if interrupts delayed sending.
 enum { adb_cmd_write = 0x28 };
-void adb_host_listen( uint8_t cmd, uint8_t data_h, uint8_t data_l );
+bool adb_host_listen( uint8_t cmd, uint8_t data_h, uint8_t data_l );
 
-// Sends command and receives two bytes of data from keyboard, or adb_host_* if no response/error
+// Sends command and receives two bytes of data from keyboard, or adb_host_* if no response/error.
+// Interrupts are disabled only while sending and capturing response, not decoding it.
 enum { adb_cmd_read  = 0x2C };
 uint16_t adb_host_talk( uint8_t cmd );
 
+// Sends command and receives up to len (max 8) bytes into out, for registers
+// longer than two bytes. Returns number of bytes received, 0 if no response/error.
+uint8_t adb_host_talk_buf( uint8_t cmd, uint8_t* out, uint8_t len );
+
+// True if another device held the stop bit of the last command low to request
+// service (SRQ)
+bool adb_host_srq( void );
+
+// Asynchronous versions of adb_host_talk() and adb_host_listen(), only available
+// with ADB_TIMER_ENGINE. They return immediately and the transaction proceeds
+// from timer interrupts, which must be enabled.
+void adb_host_talk_start( uint8_t cmd );
+void adb_host_listen_start( uint8_t cmd, uint8_t data_h, uint8_t data_l );
+
+// True while transaction started above is in progress
+bool adb_host_busy( void );
+
+// Data received by last adb_host_talk_start(), or adb_host_* if no response/error.
+// After adb_host_listen_start(), adb_host_error if another device drove data
+// low while we were sending it (collision), or a step was late enough that
+// device might have misread a bit.
+uint16_t adb_host_result( void );
+
+// Measures bit cell and duty cycle of device at addr from its register 3
+// response, and refines the thresholds and timeout used to receive from it.
+// Call a few times at startup and occasionally after. Returns false if device
+// didn't respond properly or its handler ID changed since the previous call.
+bool adb_host_calibrate( uint8_t addr );
+
+// Edge times of last response, captured before decoding, for diagnosing a
+// misbehaving keyboard. Times are TCNT0 values (F_CPU/8), first edge is start
+// bit's fall, last is stop bit's fall. Returns number of edges.
+uint8_t adb_host_edges( uint8_t const** edges );
+
+// Link health counters, for monitoring. Counters stop at 0xFFFF rather than wrapping.
+typedef struct adb_host_stats_t
+{
+	uint16_t ok;            // responses received
+	uint16_t no_response;   // device didn't begin response (normal when keyboard is idle)
+	uint16_t low_timeout;   // data stayed low too long within a bit
+	uint16_t high_timeout;  // data stayed high too long within a bit, cutting response short
+	uint16_t bad_start;     // response's start bit wasn't a 1
+	uint16_t max_irq_off;   // longest time interrupts were disabled, in microseconds
+} adb_host_stats_t;
+
+extern adb_host_stats_t adb_host_stats;
+
 // Sets keyboard LEDs. Note that bits are inverted here, so 1 means off, 0 means on.
 void adb_host_kbd_led( uint8_t led );
 
 // State of power switch (false = pressed), or true if unsupported
 bool adb_host_psw( void );
 
+// Enables or disables interrupt that wakes CPU from sleep when power switch
+// is pressed. Returns true if it was pressed since last enabled. Does nothing
+// and returns false if unsupported.
+bool adb_host_psw_wake( bool enable );
+
 
 #define ADB_POWER       0x7F
 #define ADB_CAPS        0x39
@@ -0,0 +1,114 @@
+// ADB mouse or trackball at address 3, reported as USB boot mouse
+
+#include <stdint.h>
+
+// Switches mouse to extended or higher resolution mode if it supports one
+void adb_mouse_init( void );
+
+// Handles register 0 data from mouse
+void adb_mouse_handle( uint16_t data );
+
+// Sends accumulated motion and buttons if USB is ready for them. Call often.
+void adb_mouse_update( void );
+
+
+//// Source
+
+#include <stdbool.h>
+#include "adb.h"
+#include "usb_keyboard.h"
+#include "config.h"
+
+// Motion from lower-resolution mice is scaled up to about this
+#ifndef ADB_MOUSE_CPI
+	#define ADB_MOUSE_CPI 400
+#endif
+
+enum { mouse_addr = 3 };
+enum { mouse_max_motion = 0x3FFF };
+
+static uint8_t mouse_scale = ADB_MOUSE_CPI / 100;
+static bool    mouse_extended;  // handler 4, which also reports second button
+static int16_t mouse_x;         // motion not yet sent to host
+static int16_t mouse_y;
+static uint8_t mouse_buttons;
+static bool    mouse_changed;
+
+// Sets handler ID and returns true if mouse accepted it
+static bool mouse_set_handler( uint8_t id )
+{
+	// Keep address and service requests enabled
+	adb_host_listen( adb_cmd_listen( mouse_addr, 3 ), 0x20 | mouse_addr, id );
+	return (adb_host_talk( adb_cmd_talk( mouse_addr, 3 ) ) & 0xFF) == id;
+}
+
+void adb_mouse_init( void )
+{
+	uint16_t cpi = 100; // handler 1
+	if ( mouse_set_handler( 4 ) )
+	{
+		// Register 1 is identifier, resolution, class, and button count
+		uint8_t info [8];
+		if ( adb_host_talk_buf( adb_cmd_talk( mouse_addr, 1 ), info, sizeof info ) == sizeof info )
+			cpi = info [4] << 8 | info [5];
+		mouse_extended = true;
+	}
+	else if ( mouse_set_handler( 2 ) )
+	{
+		cpi = 200;
+	}
+	
+	mouse_scale = 1;
+	if ( cpi && cpi < ADB_MOUSE_CPI )
+		mouse_scale = ADB_MOUSE_CPI / cpi;
+}
+
+// Adds 7-bit signed motion to total, saturating it
+static void mouse_add( int16_t* total, uint8_t bits )
+{
+	int16_t n = *total + ((int8_t) (bits << 1) >> 1) * mouse_scale;
+	if ( n > mouse_max_motion )
+		n = mouse_max_motion;
+	if ( n < -mouse_max_motion )
+		n = -mouse_max_motion;
+	*total = n;
+}
+
+// Removes as much motion from total as fits in a report
+static int8_t mouse_take( int16_t* total )
+{
+	int16_t n = *total;
+	if ( n > 127 )
+		n = 127;
+	if ( n < -127 )
+		n = -127;
+	*total -= n;
+	return n;
+}
+
+void adb_mouse_handle( uint16_t data )
+{
+	// Buttons are 0 when pressed
+	uint8_t buttons = (data & 0x8000) ? 0 : 1;
+	if ( mouse_extended && !(data & 0x0080) )
+		buttons |= 2;
+	
+	mouse_buttons = buttons;
+	mouse_add( &mouse_y, data >> 8 );
+	mouse_add( &mouse_x, data );
+	mouse_changed = true;
+}
+
+void adb_mouse_update( void )
+{
+	if ( mouse_changed && usb_mouse_ready() )
+	{
+		mouse_report_ [0] = mouse_buttons;
+		mouse_report_ [1] = mouse_take( &mouse_x );
+		mouse_report_ [2] = mouse_take( &mouse_y );
+		usb_mouse_send();
+		
+		// Motion left over from fast movement goes in following reports
+		mouse_changed = mouse_x || mouse_y;
+	}
+}
@@ -1,19 +1,39 @@
 // Conversion from ADB to USB, including locking caps to momentary caps USB uses
 
+#include <stdbool.h>
 #include <stdint.h>
 
-// Init ADB reading and initialize keyboard
+// Init ADB reading. Keyboard must have had at least 300ms to power up before
+// adb_usb_setup().
 void adb_usb_init( void );
 
+// Finds keyboards and other devices, and enables left/right modifier codes
+void adb_usb_setup( void );
+
 // Handle an ADB key press/release byte and update keyboard_modifiers and keyboard_keys.
 void adb_usb_handle( uint8_t raw );
 
-// Reads new ADB event pair from keyboard and releases caps if necessary
+// Reads new ADB event pair from a keyboard and releases caps if necessary.
+// Following calls to adb_usb_handle() use that keyboard's keymap.
 uint16_t adb_usb_read( void );
 
 // Call tens of times a second
 void adb_usb_update_leds( void );
 
+// Reads keyboard's modifier state from register 2 and fixes any modifiers
+// the report has wrong, such as one left pressed after its release was lost
+void adb_usb_resync( void );
+
+// True if host has changed LEDs since last adb_usb_update_leds()
+bool adb_usb_leds_changed( void );
+
+// Poll period keyboard model handles reliably, in half USB frames (4ms)
+uint8_t adb_usb_poll_period( void );
+
+// True once after keyboard at address 2 was replaced or plugged back in and
+// has been set up again, so adb_usb_poll_period() might have changed
+bool adb_usb_replugged( void );
+
 
 //// Source
 
@@ -22,9 +42,14 @@ void adb_usb_update_leds( void );
 #include "adb.h"
 #include "usb_keyboard.h"
 
+#if ADB_MOUSE
+	#include "adb_mouse.h"
+#endif
+
 static void adb_usb_handle_( uint8_t raw )
 {
-	usb_keyboard_event( keymap_to_usb( raw & 0x7f ), ~raw & 0x80 );
+	bool pressed = ~raw & 0x80;
+	usb_keyboard_event( keymap_event( raw & 0x7f, pressed ), pressed );
 }
 
 // Locking caps to USB momentary caps
@@ -69,49 +94,466 @@ static void caps_event( uint8_t raw )
 	}
 }
 
+// Other ADB devices are polled only when one requests service (SRQ), so they
+// don't take slots from the keyboard otherwise. Data from devices we have no
+// driver for is just consumed, which ends their service request.
+
+enum { kbd_addr = 2 };
+
+static uint16_t other_devices;  // bit per ADB address
+static uint8_t  other_addr;     // device to poll on next SRQ
+static bool     srq_pending;
+
+// Advances other_addr to next device after it
+static void next_other( void )
+{
+	uint8_t n;
+	for ( n = 16; n; n-- )
+	{
+		other_addr = (other_addr + 1) & 0x0F;
+		if ( other_devices >> other_addr & 1 )
+			break;
+	}
+}
+
+static void find_other_devices( void )
+{
+	uint8_t addr;
+	for ( addr = 1; addr < 16; addr++ )
+	{
+		if ( addr == kbd_addr )
+			continue;
+		
+		uint16_t r = adb_host_talk( adb_cmd_talk( addr, 3 ) );
+		if ( r != adb_host_nothing && r != adb_host_error )
+			other_devices |= 1 << addr;
+	}
+}
+
+// Adjustable Keyboard's sound buttons are a separate device, with same register
+// 0 format as a keyboard
+
+enum { appliance_addr = 7 };
+
+static void appliance_event( uint8_t raw )
+{
+	usb_keyboard_event( keymap_appliance_to_usb( raw & 0x7f ), ~raw & 0x80 );
+}
+
+static void appliance_handle( uint16_t data )
+{
+	appliance_event( data >> 8 );
+	if ( (data & 0xFF) != 0xFF && (data & 0xFF) != data >> 8 )
+		appliance_event( data );
+}
+
+// Several keyboards can be used at once. The first is at kbd_addr and polled
+// normally, the others are moved to free addresses and polled on SRQ. Each
+// uses its own keymap, but all go into the same USB report.
+
+enum { max_keyboards = 4 };
+
+static uint8_t kbd_addrs [max_keyboards] = { kbd_addr };
+static uint8_t kbd_ids   [max_keyboards]; // handler IDs
+static uint8_t kbd_count = 1;
+static uint8_t kbd_cur;
+
+// Uses keymap of keyboard n for following events
+static void kbd_select( uint8_t n )
+{
+	if ( kbd_cur != n )
+	{
+		kbd_cur = n;
+		keymap_init( kbd_ids [n] );
+	}
+}
+
+// Index of keyboard at addr, or 0 if it's not an additional keyboard
+static uint8_t kbd_find( uint8_t addr )
+{
+	uint8_t n;
+	for ( n = kbd_count; --n; )
+		if ( kbd_addrs [n] == addr )
+			return n;
+	return 0;
+}
+
+static uint8_t free_address( void )
+{
+	uint8_t addr;
+	for ( addr = 15; addr > 7; addr-- )
+		if ( !(other_devices >> addr & 1) )
+			return addr;
+	return 0;
+}
+
+// All keyboards start out at kbd_addr. Handler 0xFE tells only the one that
+// didn't detect a collision while answering the previous Talk R3 to move to the
+// new address. This repeats until none answer at kbd_addr, then the last one
+// found is moved back there.
+static void find_keyboards( void )
+{
+	uint8_t n = 0;
+	uint8_t tries = max_keyboards * 2;
+	while ( n < max_keyboards && tries-- )
+	{
+		if ( adb_host_talk( adb_cmd_read + 3 ) == adb_host_nothing )
+			break;
+		
+		uint8_t addr = free_address();
+		if ( !addr || !adb_host_listen( adb_cmd_write + 3, addr, 0xFE ) )
+			continue;
+		
+		uint16_t id = adb_host_talk( adb_cmd_talk( addr, 3 ) );
+		if ( id != adb_host_nothing && id != adb_host_error )
+		{
+			kbd_addrs [n] = addr;
+			kbd_ids   [n] = id;
+			other_devices |= 1 << addr;
+			n++;
+		}
+	}
+	
+	if ( n )
+	{
+		// Last one goes back to kbd_addr and becomes first
+		n--;
+		adb_host_listen( adb_cmd_listen( kbd_addrs [n], 3 ), kbd_addr, 0xFE );
+		other_devices &= ~(1 << kbd_addrs [n]);
+		
+		uint8_t id = kbd_ids [n];
+		kbd_ids   [n] = kbd_ids [0];
+		kbd_addrs [n] = kbd_addrs [0];
+		kbd_ids   [0] = id;
+		kbd_addrs [0] = kbd_addr;
+		kbd_count = n + 1;
+	}
+	
+	for ( n = 0; n < kbd_count; n++ )
+	{
+		// Enable separate key codes for left/right shift/control/option keys
+		// on Apple Extended Keyboard. Additional keyboards must also have
+		// service requests enabled.
+		uint8_t addr = kbd_addrs [n];
+		adb_host_listen( adb_cmd_listen( addr, 3 ), (n ? 0x20 : 0) | addr, 0x03 );
+	}
+	
+	keymap_init( kbd_ids [0] );
+}
+
+// Bit timing of each device is measured at startup, then refined while
+// keyboard is idle, one device at a time
+
+enum { calibrate_interval = 250 }; // idle polls between refinements
+
+static uint8_t idle_polls; // consecutive polls without data
+
+static uint16_t all_devices( void )
+{
+	return other_devices | 1 << kbd_addr;
+}
+
+static void calibrate_next( void )
+{
+	static uint8_t addr;
+	do
+		addr = (addr + 1) & 0x0F;
+	while ( !(all_devices() >> addr & 1) );
+	
+	adb_host_calibrate( addr );
+}
+
+static void calibrate_all( void )
+{
+	uint8_t addr;
+	for ( addr = 1; addr < 16; addr++ )
+	{
+		uint8_t n;
+		if ( all_devices() >> addr & 1 )
+			for ( n = 4; n; n-- )
+				adb_host_calibrate( addr );
+	}
+}
+
+// Talks to device, servicing USB meanwhile if possible
+static uint16_t adb_usb_talk( uint8_t cmd )
+{
+	#if ADB_TIMER_ENGINE
+		// Keep servicing USB while transaction runs from interrupts
+		adb_host_talk_start( cmd );
+		while ( adb_host_busy() )
+			usb_keyboard_poll();
+		return adb_host_result();
+	#else
+		return adb_host_talk( cmd );
+	#endif
+}
+
+// Listens, servicing USB meanwhile if possible. Returns false on collision or
+// if data might not have been received properly.
+static bool adb_usb_listen( uint8_t cmd, uint8_t data_h, uint8_t data_l )
+{
+	#if ADB_TIMER_ENGINE
+		adb_host_listen_start( cmd, data_h, data_l );
+		while ( adb_host_busy() )
+			usb_keyboard_poll();
+		return adb_host_result() != adb_host_error;
+	#else
+		return adb_host_listen( cmd, data_h, data_l );
+	#endif
+}
+
+// Modifier resync. Register 2 has the current state of modifier keys (0 =
+// pressed), which don't distinguish left and right.
+
+static bool resync_due;     // after error
+static uint8_t resync_held; // modifiers pressed in register 2 but not report last time
+
+static const uint8_t resync_keys [4] [2] = {
+	{ 0x36, 0x7D }, // control (bit 11)
+	{ 0x38, 0x7B }, // shift
+	{ 0x3A, 0x7C }, // option
+	{ 0x37, 0x37 }  // command (bit 8)
+};
+
+void adb_usb_resync( void )
+{
+	#if !UNLOCKED_CAPS
+		bool after_error = resync_due;
+	#endif
+	resync_due = false;
+	
+	// Other keyboards' modifiers aren't in first keyboard's register 2
+	if ( kbd_count > 1 )
+		return;
+	
+	uint16_t r2 = adb_usb_talk( adb_cmd_read + 2 );
+	srq_pending = adb_host_srq();
+	if ( r2 == adb_host_nothing || r2 == adb_host_error )
+		return;
+	
+	uint8_t held = 0;
+	uint8_t i;
+	for ( i = 0; i < 4; i++ )
+	{
+		uint8_t left  = resync_keys [i] [0];
+		uint8_t right = resync_keys [i] [1];
+		bool left_on  = usb_keyboard_pressed( keymap_to_usb( left ) );
+		bool right_on = usb_keyboard_pressed( keymap_to_usb( right ) );
+		
+		if ( r2 >> (11 - i) & 1 )
+		{
+			// Released
+			if ( left_on )
+				adb_usb_handle_( left | released_mask );
+			if ( right_on && right != left )
+				adb_usb_handle_( right | released_mask );
+		}
+		else if ( !left_on && !right_on )
+		{
+			// Press might just not have been read yet, so only fix it if it's
+			// still missing next time
+			held |= 1 << i;
+			if ( resync_held >> i & 1 )
+				adb_usb_handle_( left );
+		}
+	}
+	resync_held = held;
+	
+	#if !UNLOCKED_CAPS
+		// Caps lock key stays down while locked. Only fixed after an error,
+		// since host might have changed caps from another keyboard.
+		if ( after_error )
+			caps_event( (r2 & 0x2000) ? adb_caps | released_mask : adb_caps );
+	#endif
+}
+
+
+// Hot-plug. Idle and unplugged keyboards both don't answer Talk R0, so
+// register 3 is checked now and then while keyboard is idle. A keyboard that
+// was plugged in or power-cycled has its default handler and service request
+// enable, so register 3 no longer matches what setup left it at. Setup is
+// then redone one transaction per poll slot.
+
+enum { presence_interval = 100 }; // idle polls between checks
+enum { kbd_r3_mask = 0x20FF };    // service request enable and handler ID
+
+static uint16_t kbd_r3; // after setup, or 0 if keyboard isn't there
+static bool kbd_replugged;
+
+enum { setup_none, setup_listen, setup_verify };
+static uint8_t kbd_setup;
+
+static uint8_t kbd_leds = -1; // last sent to keyboard
+
+static void check_keyboard( void )
+{
+	uint16_t r3 = adb_usb_talk( adb_cmd_talk( kbd_addr, 3 ) );
+	srq_pending = adb_host_srq();
+	if ( r3 == adb_host_error )
+		return;
+	
+	if ( r3 == adb_host_nothing )
+	{
+		kbd_r3 = 0; // unplugged
+	}
+	else if ( (r3 & kbd_r3_mask) != kbd_r3 )
+	{
+		kbd_ids [0] = r3 & 0xFF;
+		kbd_setup = setup_listen;
+	}
+}
+
+static void setup_keyboard( void )
+{
+	if ( kbd_setup == setup_listen )
+	{
+		// Same as find_keyboards()
+		if ( adb_usb_listen( adb_cmd_listen( kbd_addr, 3 ), kbd_addr, 0x03 ) )
+			kbd_setup = setup_verify;
+		return;
+	}
+	
+	uint16_t r3 = adb_usb_talk( adb_cmd_talk( kbd_addr, 3 ) );
+	srq_pending = adb_host_srq();
+	if ( r3 == adb_host_error )
+		return;
+	
+	kbd_setup = setup_none;
+	kbd_r3 = r3 & kbd_r3_mask;
+	if ( r3 == adb_host_nothing )
+		return;
+	
+	kbd_cur = 0;
+	keymap_init( kbd_ids [0] );
+	kbd_leds = -1; // new keyboard's LEDs are off
+	kbd_replugged = true;
+}
+
+bool adb_usb_replugged( void )
+{
+	bool b = kbd_replugged;
+	kbd_replugged = false;
+	return b;
+}
 
 void adb_usb_init( void )
 {
 	adb_host_init();
-	_delay_ms( 300 ); // keyboard needs at least 250ms or it'll ignore host_listen below
-	
-	uint16_t id = adb_host_talk( adb_cmd_read + 3 );
-	if ( id == adb_host_nothing || id == adb_host_error )
-		id = 0;
-	keymap_init( id & 0xff );
+}
+
+void adb_usb_setup( void )
+{
+	find_other_devices();
+	find_keyboards();
+	next_other();
+	calibrate_all();
 	
-	// Enable separate key codes for left/right shift/control/option keys
-	// on Apple Extended Keyboard.
-	adb_host_listen( adb_cmd_write + 3, 0x02, 0x03 );
+	#if ADB_MOUSE
+		if ( other_devices >> mouse_addr & 1 )
+			adb_mouse_init();
+	#endif
 	
-	usb_init();
-	while ( !usb_configured() )
-		{ }
+	uint16_t r3 = adb_host_talk( adb_cmd_talk( kbd_addr, 3 ) );
+	if ( r3 != adb_host_nothing && r3 != adb_host_error )
+		kbd_r3 = r3 & kbd_r3_mask;
 }
 
 uint16_t adb_usb_read( void )
 {
-	cli(); // don't let anything upset ADB timing
-	uint16_t keys = adb_host_kbd_recv();
-	sei();
+	uint16_t keys = adb_host_nothing;
+	if ( kbd_setup )
+	{
+		setup_keyboard();
+	}
+	else if ( srq_pending && other_devices )
+	{
+		uint16_t data = adb_usb_talk( adb_cmd_talk( other_addr, 0 ) );
+		srq_pending = adb_host_srq();
+		
+		// Keep device first in line while it has data, otherwise try next one
+		uint8_t n;
+		if ( data == adb_host_nothing || data == adb_host_error )
+		{
+			next_other();
+		}
+		else if ( (n = kbd_find( other_addr )) != 0 )
+		{
+			kbd_select( n );
+			keys = data;
+		}
+		else if ( other_addr == appliance_addr )
+		{
+			appliance_handle( data );
+		}
+		#if ADB_MOUSE
+			else if ( other_addr == mouse_addr )
+				adb_mouse_handle( data );
+		#endif
+	}
+	else if ( resync_due )
+	{
+		// Use this poll to fix modifier state after error
+		adb_usb_resync();
+	}
+	else if ( idle_polls && idle_polls % presence_interval == 0 )
+	{
+		// Check in place of a poll
+		idle_polls++;
+		check_keyboard();
+	}
+	else if ( idle_polls >= calibrate_interval )
+	{
+		// Use this poll to refine timing, since keyboard isn't being used
+		idle_polls = 0;
+		calibrate_next();
+		srq_pending = adb_host_srq();
+	}
+	else
+	{
+		kbd_select( 0 );
+		keys = adb_usb_talk( adb_cmd_read + 0 );
+		srq_pending = adb_host_srq();
+		idle_polls = (keys == adb_host_nothing) ? idle_polls + 1 : 0;
+		
+		// Key release might have been lost
+		if ( keys == adb_host_error )
+			resync_due = true;
+		
+		// Check modifiers now and then when keyboard is idle, in case there
+		// are no spare slots
+		if ( idle_polls == calibrate_interval / 2 )
+			resync_due = true;
+	}
 	
 	caps_release();
 	
 	return keys;
 }
 
+uint8_t adb_usb_poll_period( void )
+{
+	// Extended keyboards handle 125Hz. Others get the 83Hz a Mac uses, since
+	// some (M0116) are unreliable any faster.
+	return kbd_ids [0] == 0x02 ? 2 : 3;
+}
+
+bool adb_usb_leds_changed( void )
+{
+	return kbd_leds != keyboard_leds;
+}
+
 void adb_usb_update_leds( void )
 {
-	static uint8_t leds = -1;
 	uint8_t new_leds = keyboard_leds;
-	if ( leds != new_leds )
+	if ( kbd_leds != new_leds )
 	{
-		leds = new_leds;
+		kbd_leds = new_leds;
 		caps_set_leds( new_leds );
 		
-		cli();
-		adb_host_kbd_led( ~new_leds & 0x07 );
-		sei();
+		// Try again next time if it didn't get through
+		if ( !adb_usb_listen( adb_cmd_write + 2, 0, ~new_leds & 0x07 ) )
+			kbd_leds = ~new_leds;
 	}
 }
 
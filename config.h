@@ -21,8 +21,15 @@
 	#define ADB_PIN  PIND
 	#define ADB_DDR  DDRD
 	#define ADB_DATA_BIT 0
+	#define ADB_ON_PORTD 1 // needed by ADB_PSW_BIT
 #endif
 
+// Uses separate power switch line of some keyboards (ADB pin 2) to wake host
+// immediately, rather than polling keyboard for power key while host is
+// asleep. Must be on PD3 (INT1), so ADB data must also
+// be on PORTD. Lets CPU sleep until switch is pressed.
+//#define ADB_PSW_BIT 3
+
 // Drives 1K-buffered TXD high so it can be used directly as ADB data pull-up
 //#define ADB_TXD_PULLUP 1
 
@@ -30,4 +37,23 @@
 // with USB interrupts. Shouldn't cause any problems.
 #define ADB_REDUCED_TIME 1
 
+// Supports ADB mouse or trackball at address 3, as a second USB HID interface.
+// Motion from lower-resolution mice is scaled up to about ADB_MOUSE_CPI.
+//#define ADB_MOUSE 1
+#define ADB_MOUSE_CPI 400
+
+// Uses N-key rollover report (bitmap of keys) instead of boot keyboard report's
+// six keys, except when host selects boot protocol (BIOS). Reports take three
+// USB packets, so they reach host two polls later.
+//#define USB_NKRO 1
+
+// Sends System Control (power) and Consumer (volume, mute, eject) keys in
+// their own reports on a second interface, shared with ADB_MOUSE. Otherwise
+// keymap entries for them are ignored.
+//#define USB_EXTRA_KEYS 1
+
+// Runs ADB transactions from Timer2 interrupts so USB can be serviced during
+// them. Interrupts are only disabled while receiving the keyboard's response.
+//#define ADB_TIMER_ENGINE 1
+
 #endif
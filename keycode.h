@@ -50,6 +50,31 @@ along with this program. If not, see <http://www.gnu.org/licenses/>. */
 #define KC_NUBS KC_NONUS_BSLASH
 #define KC_ERAS KC_ALT_ERASE,
 #define KC_CLR  KC_CLEAR
+/* System Control and Consumer */
+#define KC_PWR  KC_SYSTEM_POWER
+#define KC_SLEP KC_SYSTEM_SLEEP
+#define KC_WAKE KC_SYSTEM_WAKE
+#define KC_MUTE KC_AUDIO_MUTE
+#define KC_VOLU KC_AUDIO_VOL_UP
+#define KC_VOLD KC_AUDIO_VOL_DOWN
+#define KC_MNXT KC_MEDIA_NEXT_TRACK
+#define KC_MPRV KC_MEDIA_PREV_TRACK
+#define KC_MSTP KC_MEDIA_STOP
+#define KC_MPLY KC_MEDIA_PLAY_PAUSE
+#define KC_MSEL KC_MEDIA_SELECT
+#define KC_EJCT KC_MEDIA_EJECT
+/* Layers (keymap only) */
+#define KC_TRNS KC_TRANSPARENT
+#define KC_MO1  (KC_LAYER_MO + 1)
+#define KC_MO2  (KC_LAYER_MO + 2)
+#define KC_MO3  (KC_LAYER_MO + 3)
+#define KC_TG1  (KC_LAYER_TG + 1)
+#define KC_TG2  (KC_LAYER_TG + 2)
+#define KC_TG3  (KC_LAYER_TG + 3)
+#define KC_DF0  (KC_LAYER_DF + 0)
+#define KC_DF1  (KC_LAYER_DF + 1)
+#define KC_DF2  (KC_LAYER_DF + 2)
+#define KC_DF3  (KC_LAYER_DF + 3)
 /* Japanese specific */
 #define KC_ZKHK KC_GRAVE
 #define KC_RO   KC_INT1
@@ -263,6 +288,28 @@ enum hid_keyboard_keypad_usage {
     KC_CRSEL,
     KC_EXSEL,           /* 0xA4 */
 
+    /* System Control, sent in separate report (USB_EXTRA_KEYS) */
+    KC_SYSTEM_POWER     = 0xA5,
+    KC_SYSTEM_SLEEP,
+    KC_SYSTEM_WAKE,
+
+    /* Consumer, sent in separate report (USB_EXTRA_KEYS) */
+    KC_AUDIO_MUTE,      /* 0xA8 */
+    KC_AUDIO_VOL_UP,
+    KC_AUDIO_VOL_DOWN,
+    KC_MEDIA_NEXT_TRACK,
+    KC_MEDIA_PREV_TRACK,
+    KC_MEDIA_STOP,
+    KC_MEDIA_PLAY_PAUSE,
+    KC_MEDIA_SELECT,
+    KC_MEDIA_EJECT,     /* 0xB0 */
+
+    /* Layer keys, only in keymap (see keymap.h). Layer n is added to these. */
+    KC_TRANSPARENT      = 0x01, /* lower layer's entry (0x01 isn't a key) */
+    KC_LAYER_MO         = 0xC0, /* momentary */
+    KC_LAYER_TG         = 0xC4, /* toggle */
+    KC_LAYER_DF         = 0xC8, /* default */
+    KC_LAYER_END        = 0xCC,
 
     /* Modifiers */
     KC_LCTRL            = 0xE0,
@@ -1,13 +1,21 @@
 // Maps ADB key codes to USB key codes
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // Initialize with given ADB keyboard model (handler ID)
 void keymap_init( uint8_t keyboard_id );
 
-// Convert ADB to USB key code
+// Convert ADB to USB key code, using layers currently active
 uint8_t keymap_to_usb( uint8_t code );
 
+// Convert ADB key press/release to USB key code. A release uses the layer the
+// key was pressed on. Layer keys change layers and give KC_NO.
+uint8_t keymap_event( uint8_t code, bool pressed );
+
+// Convert key code from Adjustable Keyboard's sound buttons to USB key code
+uint8_t keymap_appliance_to_usb( uint8_t code );
+
 
 //// Source
 
@@ -113,7 +121,31 @@ along with this program. If not, see <http://www.gnu.org/licenses/>. */
 
 #include "user_keymap.h"
 
+// Layers. A keymap can have up to max_layers, in order. The default layer (0
+// unless changed with a KC_DFn key) is always active, and momentary (KC_MOn)
+// and toggle (KC_TGn) keys activate others. A key uses the highest active
+// layer whose entry for it isn't KC_TRNS. Each layer looked at is one
+// PROGMEM read, so lookup never takes more than max_layers reads. Layer state
+// is shared by all keyboards, as modifiers are, so a KC_MOn key on one changes
+// the others.
+
+enum { max_layers = 4 };
+
+#define LAYER_COUNT( map ) (sizeof map / sizeof map [0])
+
+// Fails to compile if map has too many layers for key_layers to record
+#define CHECK_LAYERS( map ) \
+	typedef char map##_has_too_many_layers [LAYER_COUNT( map ) <= max_layers ? 1 : -1]
+
+CHECK_LAYERS( keymap_extended );
+CHECK_LAYERS( keymap_compact );
+
 static const uint8_t (*keymap) [128] = keymap_extended;
+static uint8_t keymap_layers = LAYER_COUNT( keymap_extended );
+
+static uint8_t layers_on;     // bit per layer
+static uint8_t layer_default;
+static uint8_t key_layers [128 / 4]; // layer each key was pressed on, two bits per key
 
 void keymap_init( uint8_t keyboard_id )
 {
@@ -122,16 +154,98 @@ void keymap_init( uint8_t keyboard_id )
 	case 0x08: // M0487
 	case 0x01: // M0116
 		keymap = keymap_compact;
+		keymap_layers = LAYER_COUNT( keymap_compact );
 		break;
 	
 	case 0x02:
 	default:
 		keymap = keymap_extended;
+		keymap_layers = LAYER_COUNT( keymap_extended );
 		break;
 	}
 }
 
+// Entry in highest active layer that isn't transparent, and sets *layer to it
+static uint8_t layer_lookup( uint8_t adb, uint8_t* layer )
+{
+	uint8_t active = layers_on | 1 << layer_default;
+	uint8_t n = keymap_layers;
+	while ( n-- )
+	{
+		if ( active >> n & 1 )
+		{
+			uint8_t code = pgm_read_byte( &keymap [n] [adb] );
+			if ( code != KC_TRNS )
+			{
+				*layer = n;
+				return code;
+			}
+		}
+	}
+	
+	*layer = layer_default;
+	return KC_NO;
+}
+
+static void layer_key( uint8_t code, bool pressed )
+{
+	uint8_t mask = 1 << (code & (max_layers - 1));
+	if ( code < KC_LAYER_TG )
+	{
+		layers_on |= mask;
+		if ( !pressed )
+			layers_on ^= mask;
+	}
+	else if ( pressed )
+	{
+		if ( code < KC_LAYER_DF )
+			layers_on ^= mask;
+		else
+			layer_default = code & (max_layers - 1);
+	}
+}
+
 uint8_t keymap_to_usb( uint8_t adb )
 {
-	return pgm_read_byte( &keymap [0] [adb] );
+	uint8_t layer;
+	uint8_t code = layer_lookup( adb, &layer );
+	return (code < KC_LAYER_MO || code >= KC_LAYER_END) ? code : KC_NO;
+}
+
+uint8_t keymap_event( uint8_t adb, bool pressed )
+{
+	uint8_t* bits = &key_layers [adb >> 2];
+	uint8_t shift = (adb & 3) * 2;
+	uint8_t layer;
+	uint8_t code;
+	if ( pressed )
+	{
+		code = layer_lookup( adb, &layer );
+		*bits = (*bits & ~(3 << shift)) | layer << shift;
+	}
+	else
+	{
+		code = KC_NO;
+		layer = *bits >> shift & 3;
+		if ( layer < keymap_layers )
+			code = pgm_read_byte( &keymap [layer] [adb] );
+		if ( code == KC_TRNS )
+			code = KC_NO;
+	}
+	
+	if ( KC_LAYER_MO <= code && code < KC_LAYER_END )
+	{
+		layer_key( code, pressed );
+		return KC_NO;
+	}
+	
+	return code;
+}
+
+uint8_t keymap_appliance_to_usb( uint8_t adb )
+{
+	if ( adb >= sizeof keymap_appliance )
+		return KC_NO;
+	
+	return pgm_read_byte( &keymap_appliance [adb] );
 }
@@ -2,9 +2,11 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <avr/io.h>
 #include <avr/power.h>
 #include <avr/sleep.h>
+#include <avr/wdt.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
 
@@ -23,41 +25,227 @@ enum { tcnt1_hz = (F_CPU + 512) / 1024 };
 	#define TIFR TIFR1
 #endif
 
+// Time base. Timer1 runs freely and is never written; its overflows extend
+// it to 32 bits.
+
+static volatile uint16_t timer1_overflows;
+static volatile bool timer1_woke; // set by Timer1 interrupts, so sleep can tell them from USB
+
+ISR(TIMER1_OVF_vect)
+{
+	timer1_overflows++;
+	timer1_woke = true;
+}
+
+// Compare interrupt stays enabled, except while it runs. With no alarm pending
+// it just runs once per overflow period.
 static void timer1_init( void )
 {
 	TCCR1B = 5<<CS10; // 1024 prescaler
-	TIMSK |= 1<<TOIE1;
+	TIMSK |= 1<<TOIE1 | 1<<OCIE1A;
 }
 
-static volatile bool usb_inactive;
+// Current time in Timer1 ticks (85us)
+static uint32_t now( void )
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t low  = TCNT1;
+	uint16_t high = timer1_overflows;
+	
+	// Overflow might have happened just before reading TCNT1
+	if ( (TIFR & (1<<TOV1)) && low < 0x8000 )
+		high++;
+	SREG = sreg;
+	
+	return (uint32_t) high << 16 | low;
+}
 
-ISR(TIMER1_OVF_vect)
+// One-shot alarms. Output compare A is set to the earliest pending one, and
+// its interrupt marks alarms that have passed as fired. The CPU can sleep
+// until then.
+
+enum { alarm_usb, alarm_idle, alarm_reset, alarm_slot, alarm_count };
+
+static uint32_t alarm_times [alarm_count];
+static uint8_t alarm_pending;         // bit per alarm
+static volatile uint8_t alarm_fired;  // bit per alarm
+
+// Marks passed alarms as fired and sets compare for next one. Interrupts must
+// be disabled, or this must be called from compare interrupt.
+static void alarm_update( void )
+{
+	for ( ;; )
+	{
+		uint32_t time = now();
+		uint8_t next = alarm_count;
+		uint8_t a;
+		for ( a = 0; a < alarm_count; a++ )
+		{
+			uint8_t bit = 1 << a;
+			if ( !(alarm_pending & bit) )
+				continue;
+			
+			int32_t left = alarm_times [a] - time;
+			if ( left <= 0 )
+			{
+				alarm_pending &= ~bit;
+				alarm_fired   |= bit;
+			}
+			else if ( next == alarm_count || left < (int32_t) (alarm_times [next] - time) )
+			{
+				next = a;
+			}
+		}
+		
+		if ( next == alarm_count )
+			break;
+		
+		// Alarms more than 16 bits away match early, and are just set again
+		OCR1A = alarm_times [next];
+		
+		// Timer might have passed compare value while it was being set
+		if ( (int32_t) (alarm_times [next] - now()) > 0 )
+			break;
+	}
+}
+
+// V-USB requires that other interrupts not delay its own
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)
 {
-	usb_inactive = true;
+	// Keep from being re-entered if compare comes due while updating.
+	// Nothing else changes alarms while main code is interrupted.
+	TIMSK &= ~(1<<OCIE1A);
+	alarm_update();
+	timer1_woke = true;
+	TIMSK |= 1<<OCIE1A;
+}
+
+// Fires alarm at time, replacing any previous time for it
+static void alarm_set( uint8_t a, uint32_t time )
+{
+	uint8_t sreg = SREG;
+	cli();
+	alarm_times [a] = time;
+	alarm_pending |= 1 << a;
+	alarm_fired   &= ~(1 << a);
+	alarm_update();
+	SREG = sreg;
+}
+
+static void alarm_cancel( uint8_t a )
+{
+	uint8_t sreg = SREG;
+	cli();
+	alarm_pending &= ~(1 << a);
+	alarm_fired   &= ~(1 << a);
+	SREG = sreg;
+}
+
+// True if alarm is pending or has fired
+static bool alarm_active( uint8_t a )
+{
+	return (alarm_pending | alarm_fired) >> a & 1;
+}
+
+// Returns true once after alarm fires
+static bool alarm_take( uint8_t a )
+{
+	if ( !(alarm_fired >> a & 1) )
+		return false;
+	
+	uint8_t sreg = SREG;
+	cli();
+	alarm_fired &= ~(1 << a);
+	SREG = sreg;
+	return true;
 }
 
-static unsigned idle_timer; // incremented at same rate as TCNT1
+static uint32_t sleep_ticks; // total time CPU has spent sleeping
+
+// Sleeps until alarm a fires or an interrupt other than Timer1's. Returns
+// true if alarm fired.
+static bool sleep_until( uint8_t a )
+{
+	for ( ;; )
+	{
+		cli();
+		if ( alarm_take( a ) )
+		{
+			sei();
+			return true;
+		}
+		
+		uint32_t start = now();
+		timer1_woke = false;
+		sleep_enable();
+		sei();
+		sleep_cpu(); // sei delays interrupts by one instruction, so none are missed
+		sleep_ticks += now() - start;
+		
+		if ( alarm_take( a ) )
+			return true;
+		
+		if ( !timer1_woke )
+			return false;
+	}
+}
+
+// Sleeps until time, even if USB interrupts meanwhile
+static void sleep_to( uint32_t time )
+{
+	alarm_set( alarm_slot, time );
+	while ( !sleep_until( alarm_slot ) )
+		{ }
+}
+
+static volatile bool usb_inactive;
 
 static void update_idle( void )
 {
 	enum { t1_from_idle = (tcnt1_hz * 4L + 500) / 1000 };
-	static unsigned prev_time;
-	if ( !keyboard_idle_period )
+	uint16_t period = keyboard_idle_period * t1_from_idle;
+	if ( !period )
 	{
-		prev_time = idle_timer;
+		alarm_cancel( alarm_idle );
 	}
-	else
+	else if ( alarm_take( alarm_idle ) )
 	{
-		unsigned elapsed = idle_timer - prev_time;
-		unsigned period = keyboard_idle_period * t1_from_idle;
-		if ( elapsed >= period )
-		{
-			prev_time = idle_timer;
-			usb_keyboard_touch();
-		}
+		alarm_set( alarm_idle, now() + period );
+		usb_keyboard_touch();
+	}
+	else if ( !alarm_active( alarm_idle ) )
+	{
+		alarm_set( alarm_idle, now() + period );
 	}
 }
 
+// Time from power-up or last USB reset until host configured us, and until
+// host took first key event, in milliseconds. 0 until it happens.
+static struct {
+	uint16_t configured;
+	uint16_t first_key;
+} startup;
+
+static uint32_t startup_time; // power-up is 0
+
+// Rounded up, so it's never 0
+static uint16_t since_startup( void )
+{
+	enum { max_ticks = 0xFFFF * (uint32_t) tcnt1_hz / 1000 };
+	uint32_t ticks = now() - startup_time;
+	if ( ticks >= max_ticks )
+		return 0xFFFF;
+	
+	return (ticks * 1000 + tcnt1_hz - 1) / tcnt1_hz;
+}
+
+static void startup_update( void )
+{
+	if ( !startup.configured && usbConfiguration )
+		startup.configured = since_startup();
+}
+
 static bool usb_was_reset;
 
 void hadUsbReset( void )
@@ -65,82 +253,164 @@ void hadUsbReset( void )
 	usb_was_reset = true;
 }
 
+// Grace period of one second after USB connect or reset, which gives host
+// time to negotiate with us before we go to only handling one USB command
+// every 8ms. See grace_step().
+static bool in_grace;
+
+static void start_grace( void )
+{
+	in_grace = true;
+	alarm_set( alarm_reset, now() + tcnt1_hz );
+}
+
 static void handle_reset( void )
 {
-	// Give host time to negotiate with us before we go to only handling one
-	// USB command every 8ms
 	if ( usb_was_reset )
 	{
-		
 		DEBUG( debug_log( 0x1c, 0, 0 ) );
+		usb_was_reset = false;
 		usb_keyboard_reset();
-		while ( TCNT1 < tcnt1_hz )
-		{
-			usb_was_reset = false;
-			usbPoll();
-			if ( usb_was_reset )
-				TCNT1 = 0;
-		}
+		startup_time = now();
+		memset( &startup, 0, sizeof startup );
+		start_grace();
 	}
+	
+	if ( in_grace && alarm_take( alarm_reset ) )
+		in_grace = false;
 }
 
 enum { inactive_timeout = tcnt1_hz / 4 }; // no USB activity signals host asleep or resetting
 
-// Waits for USB activity and returns TCNT1L after first burst of USB activity
-static uint8_t wait_usb( void )
+// Waits for USB activity and returns time of first burst of USB activity
+static uint32_t wait_usb( void )
 {
-	// accumulate time since last change to TCNT1
-	idle_timer += TCNT1 - -inactive_timeout;
-	
 	// Wake after timeout if no USB activity
-	TCNT1 = -inactive_timeout;
-	usb_inactive = false;
-	sleep_enable();
-	sleep_cpu();
+	alarm_set( alarm_usb, now() + inactive_timeout );
+	usb_inactive = sleep_until( alarm_usb );
 	
-	uint8_t time = TCNT1L;
+	uint32_t time = now();
 	_delay_us( 150 ); // sometimes there's more activity a little after first burst
 	return time;
 }
 
+uint16_t usb_keyboard_time( void )
+{
+	return now();
+}
+
+// Wakes host with resume signaling and returns true, if host allows it
+static bool wake_host( void )
+{
+	return usb_remote_wakeup();
+}
+
+// While suspended, power-down sleep stops the clock and so Timer1. It's only
+// used where a pin change on the USB lines can wake the CPU, with the
+// watchdog interrupt waking it periodically to check the power key. ATmega8's
+// INT0 only wakes from power-down on a low level, which D+ is while the bus is
+// idle, so there the CPU sleeps in idle mode and an alarm wakes it.
+#if defined(PCICR) && defined(WDTCSR)
+	#define SUSPEND_POWER_DOWN 1
+	
+	// USB lines must be on PORTB (PCINT0-7)
+	ISR(PCINT0_vect, ISR_NOBLOCK)
+	{
+		PCICR &= ~(1<<PCIE0);
+	}
+	
+	ISR(WDT_vect, ISR_NOBLOCK)
+	{
+		usb_inactive = true;
+	}
+	
+	enum { suspend_checks = 1 }; // watchdog periods (250ms) between power key checks
+#else
+	enum { check_period = tcnt1_hz / 200 }; // 5ms, well under 10ms USB reset
+	enum { suspend_checks = inactive_timeout / check_period };
+#endif
+
+// Sets up wakeup sources, then sleeps. Called with interrupts disabled.
+static void suspend_sleep( void )
+{
+	#if SUSPEND_POWER_DOWN
+		usb_inactive = false;
+		
+		// Any change on bus is resume or reset
+		PCMSK0 = USBMASK;
+		PCIFR  = 1<<PCIF0;
+		PCICR |= 1<<PCIE0;
+		
+		#ifndef ADB_PSW_BIT
+			wdt_reset();
+			WDTCSR = 1<<WDCE | 1<<WDE;
+			WDTCSR = 1<<WDIE | 1<<WDP2; // 250ms
+		#endif
+		
+		set_sleep_mode( SLEEP_MODE_PWR_DOWN );
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		
+		PCICR &= ~(1<<PCIE0);
+		wdt_disable();
+		set_sleep_mode( SLEEP_MODE_IDLE );
+	#else
+		alarm_set( alarm_usb, now() + check_period );
+		usb_inactive = sleep_until( alarm_usb );
+	#endif
+}
+
 // Waits until USB becomes active, host issues USB reset, or keyboard power key is pressed
 static void while_usb_inactive( void )
 {
 	DEBUG( debug_log( 0x1a, 0, 0 ) );
 	
-	// Wait for USB activity without any interruption
-	cli();
 	usb_was_reset = false;
-	USB_INTR_PENDING = 1<<USB_INTR_PENDING_BIT; 
-	while ( !(USB_INTR_PENDING & (1<<USB_INTR_PENDING_BIT)) ) // stop on USB activity
+	adb_host_psw_wake( true );
+	
+	// USB activity and power switch (ADB_PSW_BIT) wake CPU immediately
+	#ifndef ADB_PSW_BIT
+		uint8_t checks = 0;
+	#endif
+	for ( ;; )
 	{
+		cli();
+		suspend_sleep();
+		
+		// Power switch is re-armed, so host that doesn't allow wakeup just
+		// leaves us asleep
+		bool psw = adb_host_psw_wake( true );
+		if ( psw && wake_host() )
+			break;
+		
+		// Woken by something other than timer or power switch, so USB is active
+		if ( !usb_inactive && !psw )
+			break;
+		
 		// Check for USB reset
 		usbPoll();
 		if ( usb_was_reset )
 			break;
 		
-		// Check power key periodically
-		if ( TCNT1 >= inactive_timeout )
-		{
-			TCNT1 = 0;
-			uint16_t keys = adb_host_kbd_recv();
-			if ( (keys >> 8 & 0xFF) == 0x7F )
+		#ifndef ADB_PSW_BIT
+			// Check power key periodically
+			if ( ++checks >= suspend_checks )
 			{
-				// USB SE0 to wake host
-				USBOUT &= ~USBMASK;
-				USBDDR |= USBMASK;
-				_delay_ms( 10 );
-				USBDDR &= ~USBMASK;
-				usb_was_reset = true;
-				break;
+				checks = 0;
+				uint16_t keys = adb_host_kbd_recv();
+				if ( (keys >> 8 & 0xFF) == 0x7F && wake_host() )
+					break;
 			}
-		}
+		#endif
 	}
-	sei();
+	adb_host_psw_wake( false );
 	
 	DEBUG( debug_log( 0x1b, 0, 0 ) );
 }
 
+enum { keyboard_power_up = tcnt1_hz * 3 / 10 }; // keyboard ignores Listen R3 for 250ms
+
 static void init( void )
 {
 	#ifdef clock_prescale_set
@@ -156,157 +426,372 @@ static void init( void )
 	DDRD  = 0;
 	PORTD = 0xFF;
 	
+	ACSR = 1<<ACD; // analog comparator off
+	
 	#if ADB_TXD_PULLUP
 		PORTD |= 1<<1;
 		DDRD  |= 1<<1;
 	#endif
 	
-	adb_usb_init();
+	// Keyboard's power-up time overlaps the time USB needs to be disconnected,
+	// and devices are found before connecting, since until host configures
+	// us ADB transactions can't be kept clear of USB traffic
 	timer1_init();
+	adb_usb_init();
+	usb_init();
+	sleep_to( keyboard_power_up );
+	adb_usb_setup();
+	usb_connect();
 }
 
-static void split_adb( uint16_t keys );
+// Link health, read by host with vendor request
 
-int main( void )
+enum {
+	vendor_get_health   = 1,
+	vendor_clear_health = 2,
+	vendor_get_latency  = 3,
+	vendor_get_startup  = 4
+};
+
+static struct {
+	adb_host_stats_t adb;
+	uint16_t led_writes;
+	uint16_t polls;         // ADB polls in last second
+	uint16_t busy;          // percent of last second CPU was awake
+	uint16_t poll_period;   // milliseconds
+} health;
+
+// Key latency, from ADB poll returning event to host taking report with it
+enum { latency_buckets = 8 };
+static struct {
+	uint16_t counts [latency_buckets]; // under 1ms, 1-2ms, 2-4ms, ... 64ms and over
+	uint16_t max;                      // microseconds
+} latency;
+
+void usb_keyboard_latency( uint16_t ticks )
 {
-	init();
-	usb_was_reset = false; // already handled
+	enum { max_ticks = 0xFFFF * (uint32_t) tcnt1_hz / 1000000 };
+	uint16_t us = 0xFFFF;
+	if ( ticks < max_ticks )
+		us = ticks * 1000000UL / tcnt1_hz;
 	
-	uint8_t frame = 0;
-	for ( ;; )
+	uint8_t n = 0;
+	uint16_t limit = 1000;
+	while ( n < latency_buckets - 1 && us >= limit )
 	{
-		handle_reset();
-		
-		// Update while USB is idle before next interrupt
-		if ( usb_keyboard_poll() )
-			usb_keyboard_update();
-		
-		uint8_t synced_time = wait_usb();
-		if ( usb_inactive )
+		n++;
+		limit <<= 1;
+	}
+	if ( latency.counts [n] != 0xFFFF )
+		latency.counts [n]++;
+	
+	if ( !startup.first_key )
+		startup.first_key = since_startup();
+	
+	if ( latency.max < us )
+		latency.max = us;
+}
+
+uint8_t usb_vendor_request( uint8_t request, uint8_t const** data )
+{
+	if ( request == vendor_clear_health )
+	{
+		memset( &adb_host_stats, 0, sizeof adb_host_stats );
+		memset( &latency, 0, sizeof latency );
+		health.led_writes = 0;
+		return 0;
+	}
+	
+	if ( request == vendor_get_latency )
+	{
+		*data = (uint8_t const*) &latency;
+		return sizeof latency;
+	}
+	
+	if ( request == vendor_get_startup )
+	{
+		*data = (uint8_t const*) &startup;
+		return sizeof startup;
+	}
+	
+	if ( request != vendor_get_health )
+		return 0;
+	
+	health.adb = adb_host_stats;
+	*data = (uint8_t const*) &health;
+	return sizeof health;
+}
+
+// Poll period in half frames (4ms). Starts at what keyboard model handles,
+// speeds up while polls keep succeeding, and backs off when errors appear.
+enum { min_poll_period = 2, max_poll_period = 4 };
+static uint8_t poll_period;
+
+static void adapt_poll_period( uint16_t keys )
+{
+	enum { errors_to_slow = 3 };
+	enum { max_clean_shift = 6 };
+	static uint16_t clean;       // successful polls since last change
+	static uint8_t  errors;      // errors since last change
+	static uint8_t  clean_shift; // doubles polls needed to speed up after each slowdown
+	
+	if ( keys == adb_host_error )
+	{
+		if ( ++errors >= errors_to_slow )
 		{
-			while_usb_inactive();
-			continue;
+			if ( poll_period < max_poll_period )
+			{
+				poll_period++;
+				if ( clean_shift < max_clean_shift )
+					clean_shift++;
+			}
+			errors = 0;
+			clean  = 0;
 		}
+	}
+	else if ( ++clean >= (256u << clean_shift) )
+	{
+		// Occasional errors don't count once enough polls succeed
+		if ( !errors && poll_period > min_poll_period )
+			poll_period--;
+		errors = 0;
+		clean  = 0;
+	}
+}
+
+static uint16_t polls; // since last health task
+
+// Queues pair of ADB key events. Events for the same key are sent in separate
+// reports by usb_keyboard_update().
+static void handle_keys( uint16_t keys )
+{
+	if ( keys == adb_host_nothing || keys == adb_host_error )
+		return;
+	
+	uint8_t key1 = keys >> 8;   // != 0xFF
+	uint8_t key0 = keys & 0xFF; // possibly == 0xFF
+	
+	adb_usb_handle( key1 );
+	
+	// For some keys (e.g. power) the same event is in both bytes
+	if ( key0 != 0xFF && key0 != key1 )
+		adb_usb_handle( key0 );
+}
+
+static void poll_keys( void )
+{
+	uint16_t keys = adb_usb_read();
+	adapt_poll_period( keys );
+	handle_keys( keys );
+	polls++;
+	
+	// Different keyboard model might be plugged in
+	if ( adb_usb_replugged() )
+		poll_period = adb_usb_poll_period();
+}
+
+// Scheduler. Each pass of main loop gets one slot, starting when USB activity
+// begins a frame. Tasks have a deadline in half frames and a cost in slot
+// time. A slot runs tasks due in it in order of deadline, as long as each
+// finishes before the next frame's USB activity, then sleeps through the rest.
+// Polls keep to the poll period rather than using spare time, since some
+// keyboards can't handle a higher rate.
+
+enum { task_leds, task_poll, task_resync, task_idle, task_health, task_count };
+
+#define usec_to_tcnt1( us ) ((uint8_t) ((us) * (uint32_t) tcnt1_hz / 1000000))
+
+enum { half_frame = usec_to_tcnt1( 3300 ) }; // second half of slot starts here
+enum { slot_end   = half_frame * 2 };        // ADB work must be done by here
+enum { slot_min   = usec_to_tcnt1( 4000 ) }; // take at least until near next frame
+
+enum { resync_period = 25 };  // half frames (100ms)
+enum { health_period = 250 }; // half frames (1s)
+
+static const uint8_t task_cost [task_count] = {
+	usec_to_tcnt1( 3300 ), // LEDs: Listen R2
+	usec_to_tcnt1( 3300 ), // poll: Talk R0 of keyboard or device requesting service
+	usec_to_tcnt1( 3300 ), // resync: Talk R2
+	0,                     // idle report: just marks report dirty
+	0                      // health
+};
+
+static uint8_t task_due [task_count]; // half frames until deadline
+
+static bool task_ready( uint8_t t )
+{
+	// LEDs have no period; they're due as soon as host changes them
+	if ( t == task_leds )
+		return adb_usb_leds_changed();
+	
+	// Resync only takes a slot polling doesn't need, even if that means
+	// running late
+	if ( t == task_resync && task_ready( task_poll ) )
+		return false;
+	
+	return task_due [t] <= 1;
+}
+
+static void run_task( uint8_t t )
+{
+	switch ( t )
+	{
+	case task_leds:
+		if ( health.led_writes != 0xFFFF )
+			health.led_writes++;
+		adb_usb_update_leds();
+		break;
+	
+	case task_poll:
+		poll_keys();
+		task_due [t] += poll_period; // keeps half frame phase
+		break;
+	
+	case task_resync:
+		adb_usb_resync();
+		task_due [t] = resync_period;
+		break;
+	
+	case task_idle:
+		update_idle();
+		task_due [t] = 2; // next slot
+		break;
+	
+	case task_health: {
+		static uint32_t prev_time;
+		static uint32_t prev_sleep;
+		uint32_t time = now();
+		health.busy = 100 - (sleep_ticks - prev_sleep) * 100 / (time - prev_time);
+		prev_time  = time;
+		prev_sleep = sleep_ticks;
 		
-		usb_keyboard_update();
+		health.polls = polls;
+		health.poll_period = poll_period * 4;
+		polls = 0;
+		task_due [t] = health_period;
+		break;
+	}
+	}
+}
+
+static void run_slot( uint32_t synced_time )
+{
+	for ( ;; )
+	{
+		uint8_t elapsed = now() - synced_time;
 		
-		// Poll ADB every two out of three frames
-		if ( frame <= 1 )
+		// Earliest deadline among tasks that can finish in time. Ties go to
+		// lower task number.
+		uint8_t best = task_count;
+		uint8_t t;
+		for ( t = 0; t < task_count; t++ )
 		{
-			// Delay second poll by half a frame
-			enum { half_interrupt = 3300L * tcnt1_hz / 1000000 };
-			if ( frame == 1 )
-				while ( (uint8_t) (TCNT1L - synced_time) < half_interrupt )
-					{ }
+			if ( !task_ready( t ) )
+				continue;
 			
-			split_adb( adb_usb_read() );
-			update_idle();
+			// Task due in second half of slot doesn't start before then
+			uint8_t start = elapsed;
+			if ( task_due [t] == 1 && start < half_frame )
+				start = half_frame;
 			
-			frame++;
-		}
-		else
-		{
-			// Every third frame, update LEDs instead of polling ADB
-			// This also gives USB a chance to send LED updates
-			adb_usb_update_leds();
+			if ( start + task_cost [t] > slot_end )
+				continue;
 			
-			// Take at least until near the next 8ms USB slot
-			enum { min_time = 4000L * tcnt1_hz / 1000000 };
-			while ( (uint8_t) (TCNT1L - synced_time) < min_time )
-				{ }
-			
-			frame = 0;
+			if ( best == task_count || task_due [t] < task_due [best] )
+				best = t;
 		}
+		
+		if ( best == task_count )
+			break;
+		
+		if ( task_due [best] == 1 )
+			sleep_to( synced_time + half_frame );
+		
+		run_task( best );
 	}
 	
-	return 0;
+	sleep_to( synced_time + slot_min );
+	
+	// Slot is two half frames
+	uint8_t t;
+	for ( t = 0; t < task_count; t++ )
+		task_due [t] = (task_due [t] > 2) ? task_due [t] - 2 : 0;
 }
 
-// Splits pair of ADB key events into multiple USB reports if necessary
-static void split_adb( uint16_t keys )
+// During grace period, USB is serviced as soon as it's active, rather than
+// once per frame. There are no regular frames to synchronize ADB with, so
+// it's only used once USB has been quiet for a while. Key events are queued
+// and only sent once host has configured us.
+static void grace_step( void )
 {
-	static uint8_t adb_extra_ = 0xFF;
+	enum { quiet = usec_to_tcnt1( 3000 ) };
+	static uint32_t next_poll;
 	
-	// The three potential events (0xFF=none), listed in order of occurrence
-	uint8_t key2 = adb_extra_;  // possibly == 0xFF
-	uint8_t key1 = keys >> 8;   // != 0xFF
-	uint8_t key0 = keys & 0xFF; // possibly == 0xFF
+	alarm_set( alarm_slot, now() + quiet );
+	bool usb_quiet = sleep_until( alarm_slot );
+	usbPoll();
 	
-	// We've got three events, some or all of which could be for the same key.
-	// In that case, we must send the updates over USB separately or lose a
-	// key press. There are an exasperating number of possible situations
-	// (uppercase = pressed, lowercase = released):
-	//
-	// Key 
-	// 210 Sends Extra
-	// ---------------
-	// -B-   B   -
-	// -BC   BC  -
-	// -Bb   B   b
-	// AB-   AB  -
-	// ABC   ABC -
-	// ABa   AB  a
-	// AaB   AB  a
-	// Aa-   A   a
-	// AaA A a   A
-	
-	// Parse extra now
-	adb_extra_ = 0xFF;
-	if ( key2 != 0xFF )
-		adb_usb_handle( key2 );
-	
-	// See if no new events
-	if ( keys == adb_host_nothing || keys == adb_host_error )
+	if ( usbConfiguration )
+	{
+		usb_keyboard_update();
+		
+		#if ADB_MOUSE
+			adb_mouse_update();
+		#endif
+	}
+	
+	if ( !usb_quiet )
 		return;
 	
-	// For some keys (e.g. power) the same event is in both bytes
-	if ( key0 == key1 )
-		key0 = 0xFF;
+	if ( adb_usb_leds_changed() )
+	{
+		run_task( task_leds );
+	}
+	else if ( (int32_t) (now() - next_poll) >= 0 )
+	{
+		next_poll = now() + poll_period * usec_to_tcnt1( 4000 );
+		poll_keys();
+	}
+}
+
+int main( void )
+{
+	init();
 	
-	// Cases are listed below where they are handled
-		
-	if ( key2 != 0xFF )
+	poll_period = adb_usb_poll_period();
+	
+	// Host enumerates us after connect
+	start_grace();
+	
+	for ( ;; )
 	{
-		if ( ((key2 ^ key0) & 0x7F) == 0 )
+		handle_reset();
+		startup_update();
+		
+		if ( in_grace )
 		{
-			// ABa   AB  a
-			// AaA A a   A
-			
-			// If both new events are same as extra key, we must send extra,
-			// first event, then save second event as new extra
-			if ( ((key2 ^ key1) & 0x7F) == 0 )
-				usb_keyboard_update();
-			
-			// Second event matches extra, so save as new extra
-			adb_extra_ = key0;
-			adb_usb_handle( key1 );
-			return;
+			grace_step();
+			continue;
 		}
 		
-		if ( ((key2 ^ key1) & 0x7F) == 0 )
+		// Update while USB is idle before next interrupt
+		usb_keyboard_update();
+		
+		uint32_t synced_time = wait_usb();
+		if ( usb_inactive )
 		{
-			// AaB   AB  a
-			// Aa-   A   a
-			
-			// First event matches extra, so save as new extra
-			adb_extra_ = key1;
-			if ( key0 != 0xFF )
-				adb_usb_handle( key0 );
-			return;
+			while_usb_inactive();
+			continue;
 		}
 		
-		// No matches, so extra gets merged with new events
-		// AB-   AB  -
-		// ABC   ABC -
+		usb_keyboard_update();
+		
+		#if ADB_MOUSE
+			adb_mouse_update();
+		#endif
+		
+		run_slot( synced_time );
 	}
-	// -B-   B   -
-	// -BC   BC  -
-	// -Bb   B   b
 	
-	adb_usb_handle( key1 );
-	
-	if ( ((key1 ^ key0) & 0x7F) == 0 )
-		adb_extra_ = key0;
-	else if ( key0 != 0xFF )
-		adb_usb_handle( key0 );
+	return 0;
 }
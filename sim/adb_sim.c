@@ -0,0 +1,194 @@
+// Runs adb.c against simulated keyboard: polling, LED writes, SRQ, and
+// errors, reporting transaction times and whether results were right.
+// Usage: adb_sim [cell=us] [duty=fraction] [jitter=us] [tlt=us] [polls=n]
+//        [seed=n] [srq]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "../adb.h"
+
+static sim_device_t kbd;
+static sim_device_t mouse;
+static int failures;
+
+static void check( int ok, const char* what )
+{
+	printf( "%-40s %s\n", what, ok ? "ok" : "FAILED" );
+	if ( !ok )
+		failures++;
+}
+
+// Parses name=value argument into *out if name matches
+static int option( const char* arg, const char* name, double* out )
+{
+	size_t len = strlen( name );
+	if ( strncmp( arg, name, len ) || arg [len] != '=' )
+		return 0;
+	*out = atof( arg + len + 1 );
+	return 1;
+}
+
+typedef struct {
+	double min, max, total;
+	int count;
+} times_t;
+
+static void times_add( times_t* t, double us )
+{
+	if ( !t->count || us < t->min )
+		t->min = us;
+	if ( !t->count || us > t->max )
+		t->max = us;
+	t->total += us;
+	t->count++;
+}
+
+static void times_print( times_t const* t, const char* what )
+{
+	if ( t->count )
+		printf( "%-16s %5d  min %7.1f  avg %7.1f  max %7.1f us\n", what, t->count,
+				t->min, t->total / t->count, t->max );
+}
+
+int main( int argc, char** argv )
+{
+	double cell = 100, duty = 0.35, jitter = 0, tlt = 200, polls = 200, seed = 1;
+	int srq = 0;
+	
+	sim_device_init( &kbd );
+	
+	int i;
+	for ( i = 1; i < argc; i++ )
+	{
+		const char* a = argv [i];
+		if ( !strcmp( a, "srq" ) )
+			srq = 1;
+		else if ( !option( a, "cell", &cell ) && !option( a, "duty", &duty ) &&
+				!option( a, "jitter", &jitter ) && !option( a, "tlt", &tlt ) &&
+				!option( a, "polls", &polls ) && !option( a, "seed", &seed ) )
+		{
+			fprintf( stderr, "usage: adb_sim [cell=us] [duty=fraction] [jitter=us] "
+					"[tlt=us] [polls=n] [seed=n] [srq]\n" );
+			return 2;
+		}
+	}
+	
+	sim_seed( (uint32_t) seed );
+	kbd.cell_us   = cell;
+	kbd.one_low   = duty;
+	kbd.jitter_us = jitter;
+	kbd.tlt_us    = tlt;
+	sim_attach( &kbd );
+	
+	if ( srq )
+	{
+		// Mouse at address 3 with motion waiting, so it requests service
+		sim_device_init( &mouse );
+		mouse.addr    = 3;
+		mouse.handler = 1;
+		sim_device_key( &mouse, 0x81 );
+		sim_device_key( &mouse, 0x01 );
+		sim_attach( &mouse );
+	}
+	
+	printf( "cell %.1f us, 1 bit low %.0f%%, jitter %.1f us, Tlt %.0f us\n\n",
+			cell, duty * 100, jitter, tlt );
+	
+	adb_host_init();
+	
+	// Register 3 and handler change
+	uint16_t r3 = adb_host_talk( adb_cmd_read + 3 );
+	printf( "Talk R3 = %04X\n", r3 );
+	check( (r3 & 0xFF) == 0x02, "register 3 handler ID" );
+	
+	adb_host_listen( adb_cmd_write + 3, 0x02, 0x03 );
+	check( kbd.handler == 3, "listen register 3 changes handler" );
+	
+	int calibrated = 0;
+	for ( i = 0; i < 5; i++ )
+		calibrated += adb_host_calibrate( 2 );
+	check( calibrated >= 3, "calibration" );
+	
+	// Poll with key events arriving between polls
+	times_t idle = { 0 }, data = { 0 };
+	int queued = 0, received = 0, mismatches = 0, errors = 0;
+	sim_take_max_irq_off();
+	for ( i = 0; i < (int) polls; i++ )
+	{
+		// Alternate one and two events waiting
+		if ( !(i % 3) )
+		{
+			uint8_t n = (i & 4) ? 2 : 1;
+			while ( n-- )
+			{
+				uint8_t key = queued / 2 % 0x30;
+				sim_device_key( &kbd, key | (queued & 1 ? 0x80 : 0) );
+				queued++;
+			}
+		}
+		
+		double start = sim_usec();
+		uint16_t keys = adb_host_kbd_recv();
+		double time = sim_usec() - start;
+		
+		if ( keys == adb_host_nothing )
+		{
+			times_add( &idle, time );
+		}
+		else if ( keys == adb_host_error )
+		{
+			errors++;
+		}
+		else
+		{
+			times_add( &data, time );
+			
+			uint8_t k [2] = { keys >> 8, keys & 0xFF };
+			int j;
+			for ( j = 0; j < 2; j++ )
+			{
+				if ( j && k [j] == 0xFF )
+					break;
+				uint8_t expect = received / 2 % 0x30 | (received & 1 ? 0x80 : 0);
+				if ( k [j] != expect )
+					mismatches++;
+				received++;
+			}
+		}
+		
+		sim_idle_us( 5000 );
+	}
+	
+	printf( "\n" );
+	times_print( &idle, "no response" );
+	times_print( &data, "with data" );
+	printf( "errors %d, events sent %d, received %d, wrong %d\n",
+			errors, queued, received, mismatches );
+	printf( "interrupts disabled: measured max %.1f us, adb.c estimate %u us\n\n",
+			sim_take_max_irq_off(), adb_host_stats.max_irq_off );
+	check( !mismatches, "received events match" );
+	
+	// LEDs
+	adb_host_kbd_led( ~0x02 & 0x07 );
+	check( (kbd.reg [1] & 0x07) == (~0x02 & 0x07), "LED write" );
+	
+	// Service request from mouse while polling keyboard
+	if ( srq )
+	{
+		adb_host_kbd_recv();
+		check( adb_host_srq(), "SRQ detected" );
+		uint16_t m = adb_host_talk( adb_cmd_talk( 3, 0 ) );
+		check( m == 0x8101, "data from device that requested service" );
+		adb_host_kbd_recv();
+		check( !adb_host_srq(), "SRQ ends after data read" );
+	}
+	
+	printf( "\nstats: ok %u, no response %u, low timeout %u, high timeout %u, bad start %u\n",
+			adb_host_stats.ok, adb_host_stats.no_response, adb_host_stats.low_timeout,
+			adb_host_stats.high_timeout, adb_host_stats.bad_start );
+	
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+// Simulated interrupt control. There are no simulated interrupts, so this
+// only tracks the I flag, which sim uses to measure time interrupts are off.
+
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include "sim.h"
+
+#define cli() sim_cli()
+#define sei() (sim_sreg |=  0x80)
+
+#define ISR_NOBLOCK
+#define ISR( vect, ... ) void vect( void ); void vect( void )
+
+#endif
@@ -0,0 +1,22 @@
+// Simulated I/O registers for host build of adb.c. Only what adb.c uses.
+
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+#include "sim.h"
+
+// ADB data is on PORTD. Reading PIND advances virtual clock.
+#define PORTD   sim_port
+#define DDRD    sim_ddr
+#define PIND    (sim_read_pin())
+
+// Timer0 free-runs at F_CPU/8. Reading TCNT0 advances virtual clock.
+#define TCCR0   sim_tccr0
+#define TCNT0   (sim_read_tcnt0())
+#define CS00    0
+
+#define SREG    sim_sreg
+#define SREG_I  7
+
+#endif
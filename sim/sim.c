@@ -0,0 +1,431 @@
+// Virtual ADB wire, clock, and device model
+
+#include "sim.h"
+
+#include <string.h>
+
+#ifndef F_CPU
+	#error "F_CPU must be defined"
+#endif
+
+enum { data_mask = 1 }; // must match ADB_DATA_BIT
+enum { max_devices = 4 };
+
+uint8_t sim_port;
+uint8_t sim_ddr;
+uint8_t sim_tccr0;
+uint8_t sim_sreg = 0x80;
+
+static uint64_t now;
+static double   frac_cycles;
+static sim_device_t* devices [max_devices];
+static int device_count;
+
+static bool     irq_off;
+static uint64_t irq_off_start;
+static uint64_t max_irq_off;
+
+static uint32_t rand_state = 1;
+
+static uint64_t usec( double us )
+{
+	return (uint64_t) (us * (F_CPU / 1e6) + 0.5);
+}
+
+void sim_seed( uint32_t seed )
+{
+	rand_state = seed ? seed : 1;
+}
+
+// Random value from -1 to 1
+static double sim_rand( void )
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return (double) (rand_state >> 8 & 0xFFFF) / 0x8000 - 1.0;
+}
+
+static bool wire( void )
+{
+	if ( sim_ddr & data_mask )
+		return false;
+	
+	int i;
+	for ( i = 0; i < device_count; i++ )
+		if ( devices [i]->driving )
+			return false;
+	
+	return true;
+}
+
+// Device model
+
+enum {
+	st_idle,    // waiting for attention
+	st_command, // receiving command bits
+	st_srq,     // holding stop bit low to request service
+	st_stop,    // waiting for end of stop bit
+	st_tlt,     // waiting to begin response
+	st_send,    // sending response
+	st_listen   // receiving listen data
+};
+
+void sim_device_init( sim_device_t* d )
+{
+	memset( d, 0, sizeof *d );
+	d->cell_us   = 100;
+	d->one_low   = 0.35;
+	d->jitter_us = 0;
+	d->tlt_us    = 200;
+	d->srq_us    = 300;
+	d->addr      = 2;
+	d->handler   = 2;
+	d->srq_enable = true;
+	d->reg [1]   = 0xFFFF; // no modifiers pressed, LEDs off
+	d->prev_wire = true;
+}
+
+void sim_device_key( sim_device_t* d, uint8_t key )
+{
+	if ( d->key_count < sizeof d->keys )
+		d->keys [d->key_count++] = key;
+}
+
+static void add_seg( sim_device_t* d, double us )
+{
+	us += d->jitter_us * sim_rand();
+	if ( us < 1 )
+		us = 1;
+	d->segs [d->seg_count++] = usec( us );
+}
+
+static void add_bit( sim_device_t* d, int bit )
+{
+	double low = d->cell_us * (bit ? d->one_low : 1 - d->one_low);
+	add_seg( d, low );
+	add_seg( d, d->cell_us - low );
+}
+
+// Prepares response to talk, or returns false if device has nothing to say
+static bool prepare_talk( sim_device_t* d )
+{
+	uint16_t data;
+	switch ( d->cmd & 3 )
+	{
+	case 0:
+		if ( !d->key_count )
+			return false;
+		
+		data = d->keys [0] << 8 | 0xFF;
+		if ( d->key_count > 1 )
+			data = d->keys [0] << 8 | d->keys [1];
+		
+		d->key_count -= (d->key_count > 1) ? 2 : 1;
+		memmove( d->keys, d->keys + ((data & 0xFF) == 0xFF ? 1 : 2), d->key_count );
+		break;
+	
+	case 3: {
+		// Address field is random, so that devices at the same address
+		// collide while answering
+		uint8_t random_addr = (uint8_t) (sim_rand() * 8 + 8) & 0x0F;
+		data = (d->srq_enable ? 0x2000 : 0) | random_addr << 8 | d->handler;
+		break;
+	}
+	
+	default:
+		data = d->reg [(d->cmd & 3) - 1];
+		break;
+	}
+	
+	d->seg_count = 0;
+	add_bit( d, 1 );
+	int i;
+	for ( i = 15; i >= 0; i-- )
+		add_bit( d, data >> i & 1 );
+	add_seg( d, d->cell_us * (1 - d->one_low) ); // stop bit low
+	
+	return true;
+}
+
+static void apply_listen( sim_device_t* d, uint16_t data )
+{
+	d->listens++;
+	
+	switch ( d->cmd & 3 )
+	{
+	case 0:
+		break;
+	
+	case 2:
+		// Only LEDs can be written
+		d->reg [1] = (d->reg [1] & ~0x07) | (data & 0x07);
+		break;
+	
+	case 3: {
+		uint8_t addr = data >> 8 & 0x0F;
+		switch ( data & 0xFF )
+		{
+		case 0xFE: // move only if no collision
+			if ( !d->collided )
+				d->addr = addr;
+			break;
+		
+		case 0xFD: // needs activator key
+		case 0xFF: // self-test
+			break;
+		
+		case 0x00: // address and SRQ enable only
+			d->addr = addr;
+			d->srq_enable = (data & 0x2000) != 0;
+			break;
+		
+		default:
+			d->addr = addr;
+			d->srq_enable = (data & 0x2000) != 0;
+			d->handler = data & 0xFF;
+			break;
+		}
+		break;
+	}
+	
+	default:
+		d->reg [(d->cmd & 3) - 1] = data;
+		break;
+	}
+}
+
+static void command_received( sim_device_t* d )
+{
+	uint8_t addr = d->cmd >> 4;
+	if ( addr != d->addr && d->srq_enable && d->key_count )
+	{
+		d->srqs++;
+		d->driving = true;
+		d->until = now + usec( d->srq_us );
+		d->state = st_srq;
+	}
+	else
+	{
+		d->state = st_stop;
+	}
+}
+
+static void stop_ended( sim_device_t* d )
+{
+	d->state = st_idle;
+	if ( d->cmd >> 4 != d->addr )
+		return;
+	
+	if ( (d->cmd & 0x0C) == 0x0C )
+	{
+		if ( prepare_talk( d ) )
+		{
+			d->state = st_tlt;
+			d->until = now + usec( d->tlt_us );
+		}
+	}
+	else if ( (d->cmd & 0x0C) == 0x08 )
+	{
+		d->state = st_listen;
+		d->falls = 0;
+		d->bits  = 0;
+	}
+}
+
+static void device_step( sim_device_t* d, bool w )
+{
+	bool fell = d->prev_wire && !w;
+	bool rose = !d->prev_wire && w;
+	d->prev_wire = w;
+	
+	uint64_t prev_fall = d->fall;
+	if ( fell )
+		d->fall = now;
+	if ( rose )
+		d->rise = now;
+	
+	// Long low is attention, which begins a command in any state
+	if ( rose && d->state != st_send && now - prev_fall >= usec( 450 ) )
+	{
+		d->driving = false;
+		d->state = st_command;
+		d->falls = 0;
+		d->bits  = 0;
+		return;
+	}
+	
+	// Bit is 1 if its low time is less than half its cell
+	bool bit = (d->rise - prev_fall) * 2 < now - prev_fall;
+	
+	switch ( d->state )
+	{
+	case st_command:
+		// First fall ends start bit, which is merged with attention
+		if ( fell && ++d->falls >= 2 )
+		{
+			d->bits = d->bits << 1 | bit;
+			if ( d->falls == 9 )
+			{
+				// This fall begins stop bit
+				d->cmd = d->bits;
+				command_received( d );
+			}
+		}
+		break;
+	
+	case st_srq:
+		if ( now >= d->until )
+		{
+			d->driving = false;
+			d->state = st_stop;
+		}
+		break;
+	
+	case st_stop:
+		if ( rose )
+			stop_ended( d );
+		break;
+	
+	case st_tlt:
+		if ( now >= d->until )
+		{
+			d->talks++;
+			d->collided = false;
+			d->seg = 0;
+			d->driving = true;
+			d->until = now + d->segs [0];
+			d->state = st_send;
+		}
+		break;
+	
+	case st_send:
+		if ( now >= d->until )
+		{
+			if ( ++d->seg >= d->seg_count )
+			{
+				d->driving = false;
+				d->state = st_idle;
+				break;
+			}
+			d->driving = !(d->seg & 1);
+			d->until = now + d->segs [d->seg];
+			d->rise = now; // start of released time
+		}
+		else if ( !d->driving && !w && now > d->rise )
+		{
+			// Another device is driving wire low while we've released it
+			d->collided = true;
+			d->collisions++;
+			d->state = st_idle;
+		}
+		break;
+	
+	case st_listen:
+		if ( fell )
+		{
+			if ( ++d->falls >= 2 )
+				d->bits = d->bits << 1 | bit;
+			
+			// Fall of stop bit ends start bit and 16 data bits
+			if ( d->falls == 18 )
+			{
+				d->state = st_idle;
+				if ( d->bits >> 16 & 1 )
+					apply_listen( d, d->bits & 0xFFFF );
+			}
+		}
+		else if ( w && now - d->rise > usec( 400 ) && d->rise > d->fall )
+		{
+			d->state = st_idle; // host never sent data
+		}
+		break;
+	}
+}
+
+// Clock
+
+// Notices changes to I flag, which adb.c makes by writing SREG directly
+static void update_irq_off( void )
+{
+	bool off = !(sim_sreg & 0x80);
+	if ( off && !irq_off )
+		irq_off_start = now;
+	if ( !off && irq_off && now - irq_off_start > max_irq_off )
+		max_irq_off = now - irq_off_start;
+	irq_off = off;
+}
+
+static void step( void )
+{
+	bool w = wire();
+	int i;
+	for ( i = 0; i < device_count; i++ )
+		device_step( devices [i], w );
+	
+	update_irq_off();
+	now++;
+}
+
+void sim_cli( void )
+{
+	// Interrupts might have been re-enabled since clock last advanced
+	update_irq_off();
+	sim_sreg &= ~0x80;
+	update_irq_off();
+}
+
+static void advance( uint64_t cycles )
+{
+	while ( cycles-- )
+		step();
+}
+
+void sim_attach( sim_device_t* d )
+{
+	if ( device_count < max_devices )
+		devices [device_count++] = d;
+}
+
+uint8_t sim_read_pin( void )
+{
+	advance( sim_io_cycles );
+	return wire() ? 0xFF : (uint8_t) ~data_mask;
+}
+
+uint8_t sim_read_tcnt0( void )
+{
+	advance( sim_io_cycles );
+	return (uint8_t) (now / 8);
+}
+
+void sim_delay_us( double us )
+{
+	double cycles = us * (F_CPU / 1e6) + frac_cycles;
+	if ( cycles < 0 )
+		cycles = 0;
+	uint64_t whole = (uint64_t) cycles;
+	frac_cycles = cycles - whole;
+	advance( whole );
+}
+
+void sim_idle_us( double us )
+{
+	advance( usec( us ) );
+}
+
+uint64_t sim_cycles( void )
+{
+	return now;
+}
+
+double sim_usec( void )
+{
+	return now / (F_CPU / 1e6);
+}
+
+double sim_take_max_irq_off( void )
+{
+	update_irq_off();
+	double us = max_irq_off / (F_CPU / 1e6);
+	max_irq_off = 0;
+	return us;
+}
@@ -0,0 +1,93 @@
+// Virtual ADB bus for running adb.c on a PC. The wire is open-collector:
+// it's low if host or any device drives it low. Time is counted in CPU
+// cycles and only advances when adb.c delays or reads an I/O register, so
+// transaction durations are exact and repeatable.
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Registers adb.c accesses. See avr/io.h.
+extern uint8_t sim_port;
+extern uint8_t sim_ddr;
+extern uint8_t sim_tccr0;
+extern uint8_t sim_sreg;
+
+void sim_cli( void );
+uint8_t sim_read_pin( void );
+uint8_t sim_read_tcnt0( void );
+void sim_delay_us( double us );
+
+// Cycles charged for each I/O register read, approximating the instructions
+// of the loop around it
+enum { sim_io_cycles = 7 };
+
+// Current virtual time
+uint64_t sim_cycles( void );
+double sim_usec( void );
+
+// Advances virtual time without host doing anything
+void sim_idle_us( double us );
+
+// Longest time interrupts were disabled, in microseconds, and clears it
+double sim_take_max_irq_off( void );
+
+// Simulated ADB device. Answers Talk and Listen to its address, sends
+// responses with configurable timing, detects collisions and requests
+// service (SRQ) when it has data.
+typedef struct sim_device_t
+{
+	// Timing of responses
+	double  cell_us;        // bit cell
+	double  one_low;        // low time of 1 bit, as fraction of cell (0 bit is 1 - this)
+	double  jitter_us;      // each low and high time varies randomly by up to this
+	double  tlt_us;         // stop-to-start time before response
+	double  srq_us;         // how long stop bit is held low to request service
+	
+	// Register 3 and registers 1 and 2. Register 0 comes from keys.
+	uint8_t  addr;
+	uint8_t  handler;
+	bool     srq_enable;
+	uint16_t reg [3];
+	
+	// Key events (or other register 0 bytes) waiting to be read
+	uint8_t  keys [64];
+	uint8_t  key_count;
+	
+	// Counts of what device saw, for checking host's behavior
+	uint16_t talks;
+	uint16_t listens;
+	uint16_t srqs;
+	uint16_t collisions;
+	
+	// Internal state
+	int      state;
+	uint64_t fall;          // time of last falling edge
+	uint64_t rise;          // time of last rising edge
+	uint64_t until;         // end of current timed state
+	uint8_t  falls;         // falling edges since attention or listen start
+	uint32_t bits;          // bits decoded so far
+	uint8_t  cmd;
+	bool     driving;       // holding wire low
+	bool     collided;      // during last response
+	bool     prev_wire;
+	uint8_t  seg;           // current segment of response
+	uint8_t  seg_count;
+	uint32_t segs [40];     // alternating low and high times of response, in cycles
+} sim_device_t;
+
+// Sets device to an Apple Extended Keyboard at address 2 with nominal timing
+void sim_device_init( sim_device_t* d );
+
+// Adds device to bus. Up to 4.
+void sim_attach( sim_device_t* d );
+
+// Queues ADB key event byte (key code, bit 7 set for release)
+void sim_device_key( sim_device_t* d, uint8_t key );
+
+// Seeds random jitter, so runs are repeatable
+void sim_seed( uint32_t seed );
+
+#endif
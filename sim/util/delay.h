@@ -0,0 +1,11 @@
+// Simulated delays, which advance virtual clock exactly
+
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+
+#include "sim.h"
+
+#define _delay_us( us ) sim_delay_us( us )
+#define _delay_ms( ms ) sim_delay_us( (ms) * 1000.0 )
+
+#endif
@@ -19,6 +19,60 @@ uint8_t keyboard_report_ [8];
 uint8_t keyboard_idle_period;
 uint8_t keyboard_leds;
 static uint8_t protocol = 1; //	0=boot 1=report
+static uint8_t mouse_protocol = 1; // interface 1, with mouse and extra keys
+
+#if USB_NKRO
+
+uint8_t keyboard_nkro_ [22];
+
+// Report is longer than a low-speed packet, so it's sent as several. Host
+// collects them until a short one before using it.
+enum { nkro_packet = 8 };
+static uint8_t nkro_sending [sizeof keyboard_nkro_]; // copy of report being sent
+static uint8_t nkro_next; // offset after packet in USB buffer, 0 once all are taken
+
+// Queues first packet of report being sent, replacing any waiting packet
+static void nkro_restart( void )
+{
+	usbSetInterrupt( nkro_sending, nkro_packet );
+	nkro_next = nkro_packet;
+}
+
+// Same as boot report descriptor, except keys are a bitmap. Boot protocol
+// still uses boot report.
+const PROGMEM char usbHidReportDescriptor [USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
+	0x05, 0x01, // USAGE_PAGE (Generic Desktop)
+	0x09, 0x06, // USAGE (Keyboard)
+	0xa1, 0x01, // COLLECTION (Application)
+	0x05, 0x07, //	 USAGE_PAGE (Keyboard)
+	0x19, 0xe0, //	 USAGE_MINIMUM (Keyboard LeftControl)
+	0x29, 0xe7, //	 USAGE_MAXIMUM (Keyboard Right GUI)
+	0x15, 0x00, //	 LOGICAL_MINIMUM (0)
+	0x25, 0x01, //	 LOGICAL_MAXIMUM (1)
+	0x75, 0x01, //	 REPORT_SIZE (1)
+	0x95, 0x08, //	 REPORT_COUNT (8)
+	0x81, 0x02, //	 INPUT (Data,Var,Abs)
+	0x95, 0x05, //	 REPORT_COUNT (5)
+	0x75, 0x01, //	 REPORT_SIZE (1)
+	0x05, 0x08, //	 USAGE_PAGE (LEDs)
+	0x19, 0x01, //	 USAGE_MINIMUM (Num Lock)
+	0x29, 0x05, //	 USAGE_MAXIMUM (Kana)
+	0x91, 0x02, //	 OUTPUT (Data,Var,Abs)
+	0x95, 0x01, //	 REPORT_COUNT (1)
+	0x75, 0x03, //	 REPORT_SIZE (3)
+	0x91, 0x03, //	 OUTPUT (Cnst,Var,Abs)
+	0x95, 0xa8, //	 REPORT_COUNT (168)
+	0x75, 0x01, //	 REPORT_SIZE (1)
+	0x15, 0x00, //	 LOGICAL_MINIMUM (0)
+	0x25, 0x01, //	 LOGICAL_MAXIMUM (1)
+	0x05, 0x07, //	 USAGE_PAGE (Keyboard)
+	0x19, 0x00, //	 USAGE_MINIMUM (Reserved (no event indicated))
+	0x29, 0xa7, //	 USAGE_MAXIMUM (Reserved, after Keyboard ExSel)
+	0x81, 0x02, //	 INPUT (Data,Var,Abs)
+	0xc0        // END_COLLECTION
+};
+
+#else
 
 const PROGMEM char usbHidReportDescriptor [USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
 	0x05, 0x01, // USAGE_PAGE (Generic Desktop)
@@ -55,6 +109,284 @@ const PROGMEM char usbHidReportDescriptor [USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	0xc0        // END_COLLECTION  
 };
 
+#endif
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+
+// Second interface has mouse (ADB_MOUSE) and/or extra keys (USB_EXTRA_KEYS).
+// Reports need IDs only when it has extra keys.
+
+enum { mouse_report_id = 1, system_report_id = 2, consumer_report_id = 3 };
+
+#if ADB_MOUSE
+	uint8_t mouse_report_ [3];
+#endif
+
+#if USB_EXTRA_KEYS
+	uint8_t system_report_ [2]   = { system_report_id };
+	uint8_t consumer_report_ [3] = { consumer_report_id };
+#endif
+
+static const PROGMEM char second_report_descriptor [] = {
+#if ADB_MOUSE
+	0x05, 0x01, // USAGE_PAGE (Generic Desktop)
+	0x09, 0x02, // USAGE (Mouse)
+	0xa1, 0x01, // COLLECTION (Application)
+	#if USB_EXTRA_KEYS
+	0x85, mouse_report_id, // REPORT_ID (1)
+	#endif
+	0x09, 0x01, //	 USAGE (Pointer)
+	0xa1, 0x00, //	 COLLECTION (Physical)
+	0x05, 0x09, //	   USAGE_PAGE (Button)
+	0x19, 0x01, //	   USAGE_MINIMUM (Button 1)
+	0x29, 0x03, //	   USAGE_MAXIMUM (Button 3)
+	0x15, 0x00, //	   LOGICAL_MINIMUM (0)
+	0x25, 0x01, //	   LOGICAL_MAXIMUM (1)
+	0x95, 0x03, //	   REPORT_COUNT (3)
+	0x75, 0x01, //	   REPORT_SIZE (1)
+	0x81, 0x02, //	   INPUT (Data,Var,Abs)
+	0x95, 0x01, //	   REPORT_COUNT (1)
+	0x75, 0x05, //	   REPORT_SIZE (5)
+	0x81, 0x03, //	   INPUT (Cnst,Var,Abs)
+	0x05, 0x01, //	   USAGE_PAGE (Generic Desktop)
+	0x09, 0x30, //	   USAGE (X)
+	0x09, 0x31, //	   USAGE (Y)
+	0x15, 0x81, //	   LOGICAL_MINIMUM (-127)
+	0x25, 0x7f, //	   LOGICAL_MAXIMUM (127)
+	0x75, 0x08, //	   REPORT_SIZE (8)
+	0x95, 0x02, //	   REPORT_COUNT (2)
+	0x81, 0x06, //	   INPUT (Data,Var,Rel)
+	0xc0,       //	 END_COLLECTION
+	0xc0,       // END_COLLECTION
+#endif
+#if USB_EXTRA_KEYS
+	// Bit per usage, in same order as key codes
+	0x05, 0x01, // USAGE_PAGE (Generic Desktop)
+	0x09, 0x80, // USAGE (System Control)
+	0xa1, 0x01, // COLLECTION (Application)
+	0x85, system_report_id, // REPORT_ID (2)
+	0x19, 0x81, //	 USAGE_MINIMUM (System Power Down)
+	0x29, 0x83, //	 USAGE_MAXIMUM (System Wake Up)
+	0x15, 0x00, //	 LOGICAL_MINIMUM (0)
+	0x25, 0x01, //	 LOGICAL_MAXIMUM (1)
+	0x75, 0x01, //	 REPORT_SIZE (1)
+	0x95, 0x03, //	 REPORT_COUNT (3)
+	0x81, 0x02, //	 INPUT (Data,Var,Abs)
+	0x95, 0x05, //	 REPORT_COUNT (5)
+	0x81, 0x03, //	 INPUT (Cnst,Var,Abs)
+	0xc0,       // END_COLLECTION
+	0x05, 0x0c, // USAGE_PAGE (Consumer Devices)
+	0x09, 0x01, // USAGE (Consumer Control)
+	0xa1, 0x01, // COLLECTION (Application)
+	0x85, consumer_report_id, // REPORT_ID (3)
+	0x09, 0xe2, //	 USAGE (Mute)
+	0x09, 0xe9, //	 USAGE (Volume Increment)
+	0x09, 0xea, //	 USAGE (Volume Decrement)
+	0x09, 0xb5, //	 USAGE (Scan Next Track)
+	0x09, 0xb6, //	 USAGE (Scan Previous Track)
+	0x09, 0xb7, //	 USAGE (Stop)
+	0x09, 0xcd, //	 USAGE (Play/Pause)
+	0x0a, 0x83, 0x01, // USAGE (AL Consumer Control Configuration)
+	0x09, 0xb8, //	 USAGE (Eject)
+	0x15, 0x00, //	 LOGICAL_MINIMUM (0)
+	0x25, 0x01, //	 LOGICAL_MAXIMUM (1)
+	0x75, 0x01, //	 REPORT_SIZE (1)
+	0x95, 0x09, //	 REPORT_COUNT (9)
+	0x81, 0x02, //	 INPUT (Data,Var,Abs)
+	0x95, 0x07, //	 REPORT_COUNT (7)
+	0x81, 0x03, //	 INPUT (Cnst,Var,Abs)
+	0xc0,       // END_COLLECTION
+#endif
+};
+
+#endif
+
+// Keyboard, then mouse and/or extra keys as a separate interface since boot
+// protocol requires it. Replaces V-USB's so it can advertise remote wakeup.
+PROGMEM const char usbDescriptorConfiguration [USB_CFG_DESCR_PROPS_CONFIGURATION] = {
+	9, USBDESCR_CONFIG,
+	USB_CFG_DESCR_PROPS_CONFIGURATION, 0,
+	1 + USB_CFG_HAVE_INTRIN_ENDPOINT3, // interfaces
+	1,          // index of this configuration
+	0,          // configuration name string index
+	(1 << 7) | USBATTR_REMOTEWAKE, // attributes: bus powered, remote wakeup
+	USB_CFG_MAX_BUS_POWER/2,
+	
+	// Keyboard
+	9, USBDESCR_INTERFACE,
+	0,          // index of this interface
+	0,          // alternate setting
+	1 + USB_CFG_IMPLEMENT_FN_WRITEOUT, // endpoints
+	0x03, 0x01, 0x01, // HID, boot, keyboard
+	0,          // string index
+	9, USBDESCR_HID,
+	0x01, 0x01, // HID version
+	0x00,       // country code
+	0x01,       // report descriptors
+	0x22, USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+	7, USBDESCR_ENDPOINT,
+	(char) 0x81, // IN endpoint 1
+	0x03,       // interrupt
+	8, 0,       // maximum packet size
+	USB_CFG_INTR_POLL_INTERVAL,
+	#if USB_CFG_IMPLEMENT_FN_WRITEOUT
+	7, USBDESCR_ENDPOINT,
+	0x01,       // OUT endpoint 1, for LED report
+	0x03,       // interrupt
+	8, 0,       // maximum packet size
+	USB_CFG_INTR_POLL_INTERVAL,
+	#endif
+	
+	#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+	// Mouse and/or extra keys
+	9, USBDESCR_INTERFACE,
+	1,          // index of this interface
+	0,          // alternate setting
+	1,          // endpoints
+	#if ADB_MOUSE
+	0x03, 0x01, 0x02, // HID, boot, mouse
+	#else
+	0x03, 0x00, 0x00, // HID, no boot protocol
+	#endif
+	0,          // string index
+	9, USBDESCR_HID,
+	0x01, 0x01, // HID version
+	0x00,       // country code
+	0x01,       // report descriptors
+	0x22, sizeof second_report_descriptor, 0,
+	7, USBDESCR_ENDPOINT,
+	(char) (0x80 | USB_CFG_EP3_NUMBER),
+	0x03,       // interrupt
+	8, 0,       // maximum packet size
+	USB_CFG_INTR_POLL_INTERVAL
+	#endif
+};
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+
+enum { keyboard_hid_offset = 9 + 9 };
+enum { second_hid_offset = keyboard_hid_offset + 9 + 7 * (1 + USB_CFG_IMPLEMENT_FN_WRITEOUT) + 9 };
+
+// HID and report descriptors of the interface requested
+usbMsgLen_t usbFunctionDescriptor( usbRequest_t* rq )
+{
+	bool second = rq->wIndex.bytes [0] == 1;
+	
+	if ( rq->wValue.bytes [1] == USBDESCR_HID )
+	{
+		usbMsgPtr = (usbMsgPtr_t) (usbDescriptorConfiguration +
+				(second ? second_hid_offset : keyboard_hid_offset));
+		return 9;
+	}
+	
+	if ( second )
+	{
+		usbMsgPtr = (usbMsgPtr_t) second_report_descriptor;
+		return sizeof second_report_descriptor;
+	}
+	
+	usbMsgPtr = (usbMsgPtr_t) usbHidReportDescriptor;
+	return sizeof usbHidReportDescriptor;
+}
+
+#if ADB_MOUSE
+
+// Mouse report as host expects it. Report protocol needs ID in front if
+// interface also has extra keys.
+static uint8_t* mouse_packet( uint8_t* size )
+{
+	#if USB_EXTRA_KEYS
+		if ( mouse_protocol )
+		{
+			static uint8_t packet [1 + sizeof mouse_report_] = { mouse_report_id };
+			memcpy( packet + 1, mouse_report_, sizeof mouse_report_ );
+			*size = sizeof packet;
+			return packet;
+		}
+	#endif
+	
+	*size = sizeof mouse_report_;
+	return mouse_report_;
+}
+
+uint8_t usb_mouse_ready( void )
+{
+	return usbInterruptIsReady3();
+}
+
+void usb_mouse_send( void )
+{
+	uint8_t size;
+	uint8_t* packet = mouse_packet( &size );
+	usbSetInterrupt3( packet, size );
+}
+
+#endif
+
+#if USB_EXTRA_KEYS
+
+uint8_t usb_extra_ready( void )
+{
+	return usbInterruptIsReady3();
+}
+
+void usb_extra_send( uint8_t* report, uint8_t size )
+{
+	// Boot protocol host wouldn't know what report is
+	if ( mouse_protocol )
+		usbSetInterrupt3( report, size );
+}
+
+#endif
+
+#endif
+
+// Device status for GET_STATUS. Remote wakeup is set by host with
+// SET_FEATURE(DEVICE_REMOTE_WAKEUP), which V-USB doesn't handle.
+uint8_t usb_device_status;
+
+enum { feature_remote_wakeup = 1 };
+enum { status_remote_wakeup  = 1 << 1 };
+
+void hadUsbSetup( uint8_t const* data )
+{
+	usbRequest_t const* rq = (usbRequest_t const*) data;
+	if ( rq->bmRequestType == (USBRQ_DIR_HOST_TO_DEVICE | USBRQ_TYPE_STANDARD | USBRQ_RCPT_DEVICE) &&
+			rq->wValue.bytes [0] == feature_remote_wakeup )
+	{
+		if ( rq->bRequest == USBRQ_SET_FEATURE )
+			usb_device_status |= status_remote_wakeup;
+		else if ( rq->bRequest == USBRQ_CLEAR_FEATURE )
+			usb_device_status &= ~status_remote_wakeup;
+	}
+	
+	#if USB_NKRO
+		// Host reads reports afresh after this, so one partly sent starts over
+		if ( rq->bmRequestType == (USBRQ_DIR_HOST_TO_DEVICE | USBRQ_TYPE_STANDARD | USBRQ_RCPT_DEVICE) &&
+				rq->bRequest == USBRQ_SET_CONFIGURATION && nkro_next )
+			nkro_restart();
+	#endif
+}
+
+uint8_t usb_remote_wakeup( void )
+{
+	if ( !(usb_device_status & status_remote_wakeup) )
+		return false;
+	
+	// Resume is K state, which for low-speed is D+ high and D- low, for
+	// 1-15ms. Keep V-USB from seeing it as a packet.
+	cli();
+	USBOUT = (USBOUT & ~USBMASK) | (1<<USB_CFG_DPLUS_BIT);
+	USBDDR |= USBMASK;
+	_delay_ms( 10 );
+	USBOUT &= ~USBMASK;
+	USBDDR &= ~USBMASK;
+	USB_INTR_PENDING = 1<<USB_INTR_PENDING_BIT;
+	sei();
+	
+	return true;
+}
+
 uint8_t usbFunctionWrite( uint8_t data [], uint8_t len )
 {
 	(void) len;
@@ -62,10 +394,31 @@ uint8_t usbFunctionWrite( uint8_t data [], uint8_t len )
 	return 1;
 }
 
+#if USB_CFG_IMPLEMENT_FN_WRITEOUT
+
+// Host sends LED report here rather than with SET_REPORT when there's an
+// interrupt-OUT endpoint. It's one packet that doesn't need a control
+// transfer's setup and status stages.
+void usbFunctionWriteOut( uint8_t data [], uint8_t len )
+{
+	if ( len == 1 )
+		keyboard_leds = data [0];
+}
+
+#endif
+
 uint8_t usbFunctionSetup( uint8_t data [8] )
 {
 	usbRequest_t const* rq = (usbRequest_t const*) data;
 
+	if ( (rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR )
+	{
+		uint8_t const* data = 0;
+		uint8_t len = usb_vendor_request( rq->bRequest, &data );
+		usbMsgPtr = (usbMsgPtr_t) data;
+		return len;
+	}
+	
 	if ( (rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_CLASS )
 		return 0;
 	
@@ -73,6 +426,39 @@ uint8_t usbFunctionSetup( uint8_t data [8] )
 	{
 	case USBRQ_HID_GET_REPORT: // perhaps also only used for boot protocol
 		//DEBUG( debug_log( 0x01, 0, 0 ) );
+		#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+			if ( rq->wIndex.bytes [0] == 1 )
+			{
+				#if USB_EXTRA_KEYS
+					if ( rq->wValue.bytes [0] == system_report_id )
+					{
+						usbMsgPtr = system_report_;
+						return sizeof system_report_;
+					}
+					if ( rq->wValue.bytes [0] == consumer_report_id )
+					{
+						usbMsgPtr = consumer_report_;
+						return sizeof consumer_report_;
+					}
+				#endif
+				#if ADB_MOUSE
+				{
+					uint8_t size;
+					usbMsgPtr = mouse_packet( &size );
+					return size;
+				}
+				#endif
+				return 0;
+			}
+		#endif
+		#if USB_NKRO
+			if ( protocol )
+			{
+				keyboard_nkro_ [0] = keyboard_modifier_keys;
+				usbMsgPtr = keyboard_nkro_;
+				return sizeof keyboard_nkro_;
+			}
+		#endif
 		usbMsgPtr = keyboard_report_;
 		return sizeof keyboard_report_;
 	
@@ -94,11 +480,13 @@ uint8_t usbFunctionSetup( uint8_t data [8] )
 	
 	case USBRQ_HID_GET_PROTOCOL:
 		//DEBUG( debug_log( 0x04, 0, 0 ) );
-		usbMsgPtr = &protocol;
+		usbMsgPtr = rq->wIndex.bytes [0] ? &mouse_protocol : &protocol;
 		return 1;
 	
+	// Boot protocol (0) uses boot report even with USB_NKRO. Each interface
+	// has its own, so BIOS can use just one in boot protocol.
 	case USBRQ_HID_SET_PROTOCOL:
-		protocol = rq->wValue.bytes [1];
+		*(rq->wIndex.bytes [0] ? &mouse_protocol : &protocol) = rq->wValue.bytes [0];
 		//DEBUG( debug_log( 0x05, &protocol, sizeof protocol ) );
 		return 0;
 	
@@ -118,9 +506,11 @@ void usb_init( void )
 	
 	// Force USB re-enumeration in case we're being re-run while connected
 	usbDeviceDisconnect();
-	_delay_ms( 250 );
+}
+
+void usb_connect( void )
+{
 	usbDeviceConnect();
-	
 	usbInit();
 }
 
@@ -132,10 +522,31 @@ uint8_t usb_configured( void )
 
 void usb_keyboard_reset( void )
 {
+	usbConfiguration     = 0; // host sets it again after reset
 	protocol             = 1;
+	mouse_protocol       = 1;
+	usb_device_status    = 0;
 	keyboard_idle_period = 0;
 	keyboard_leds        = 0;
 	memset( keyboard_report_, 0, sizeof keyboard_report_ );
+	#if USB_NKRO
+		memset( keyboard_nkro_, 0, sizeof keyboard_nkro_ );
+		memset( nkro_sending, 0, sizeof nkro_sending );
+		
+		// Waiting packet might be from the middle of a report, which host would
+		// take as the start of one. Empty report replaces it.
+		nkro_next = 0;
+		if ( !usbInterruptIsReady() )
+			nkro_restart();
+	#endif
+	#if ADB_MOUSE
+		memset( mouse_report_, 0, sizeof mouse_report_ );
+	#endif
+	#if USB_EXTRA_KEYS
+		system_report_ [1]   = 0;
+		consumer_report_ [1] = 0;
+		consumer_report_ [2] = 0;
+	#endif
 }
 
 uint8_t usb_keyboard_poll( void )
@@ -143,6 +554,27 @@ uint8_t usb_keyboard_poll( void )
 	sei(); // so caller doesn't ever even have to enable interrupts
 	usbPoll();
 	usbPoll();
+	
+	#if USB_NKRO
+		if ( nkro_next )
+		{
+			if ( !usbInterruptIsReady() )
+				return false;
+			
+			if ( nkro_next < sizeof nkro_sending )
+			{
+				uint8_t size = sizeof nkro_sending - nkro_next;
+				if ( size > nkro_packet )
+					size = nkro_packet;
+				usbSetInterrupt( nkro_sending + nkro_next, size );
+				nkro_next += size;
+				return false;
+			}
+			
+			nkro_next = 0;
+		}
+	#endif
+	
 	return usbInterruptIsReady();
 }
 
@@ -152,6 +584,17 @@ int8_t usb_keyboard_send( void )
 		while ( !usb_keyboard_poll() )
 			{ }
 	
+	#if USB_NKRO
+		if ( protocol )
+		{
+			// usb_keyboard_poll() sends the rest
+			keyboard_nkro_ [0] = keyboard_modifier_keys;
+			memcpy( nkro_sending, keyboard_nkro_, sizeof nkro_sending );
+			nkro_restart();
+			return 0;
+		}
+	#endif
+	
 	// copies report so we don't have to worry about caller changing it before USB uses it
 	usbSetInterrupt( keyboard_report_, sizeof keyboard_report_ );
 	
@@ -8,26 +8,69 @@
 
 #include <stdint.h>
 
+// Disconnects from USB, so host will enumerate us again after usb_connect().
+// Other initialization can be done meanwhile.
 void usb_init( void );
 
+// Connects to USB. Must be at least 250ms after usb_init().
+void usb_connect( void );
+
 uint8_t usb_configured( void );
 
 // Call often (every few msec). If true, USB is ready to accept a keyboard update.
+// Also sends second half of N-key rollover report.
 uint8_t usb_keyboard_poll( void );
 
 // Call when USB reset is received or keyboard might not work in BIOS setup after reboot
 void usb_keyboard_reset( void );
 
+// Signals resume to wake suspended host, if host enabled remote wakeup. Returns
+// true if it did.
+uint8_t usb_remote_wakeup( void );
+
 // Push changes to keyboard_keys and keyboard_modifier_keys to host. If usb_keyboard_idle()
 // returned false, this blocks until USB is ready to accept keyboard data being sent.
 int8_t usb_keyboard_send( void );
 
 extern unsigned char keyboard_report_ [8];
+
+// N-key rollover report (USB_NKRO): modifiers, then bit per key code 0-167,
+// which covers every code a keymap can give (extra keys go elsewhere). Kept
+// updated along with keyboard_report_, which is used in boot protocol.
+extern unsigned char keyboard_nkro_ [22];
+enum { nkro_max_code = 167 };
 extern unsigned char keyboard_idle_period; // in 4 ms units
 extern unsigned char keyboard_leds;
 
+// Boot mouse report on second interface (ADB_MOUSE): buttons, X, Y
+extern unsigned char mouse_report_ [3];
+
+// True if USB is ready to accept a mouse update
+uint8_t usb_mouse_ready( void );
+
+// Sends mouse_report_ to host. Only call if usb_mouse_ready() returned true.
+void usb_mouse_send( void );
+
+// System Control and Consumer reports on second interface (USB_EXTRA_KEYS):
+// report ID, then bit per usage in same order as KC_SYSTEM_POWER and following
+// key codes
+extern unsigned char system_report_ [2];
+extern unsigned char consumer_report_ [3];
+
+// True if USB is ready to accept a system or consumer report
+uint8_t usb_extra_ready( void );
+
+// Sends system_report_ or consumer_report_ to host, unless it's using boot
+// protocol. Only call if usb_extra_ready() returned true.
+void usb_extra_send( unsigned char* report, uint8_t size );
+
+// Called for vendor-specific control-in requests. Implemented by user. Sets
+// *data to RAM data to send and returns its size, or returns 0 to send nothing.
+uint8_t usb_vendor_request( uint8_t request, uint8_t const** data );
+
 #define /* uint8_t */ keyboard_modifier_keys    (keyboard_report_ [0])
 #define /* uint8_t */ keyboard_keys /* [6] */   (keyboard_report_+2)
+#define /* uint8_t */ keyboard_nkro_keys /* [21] */ (keyboard_nkro_+1)
 
 #define KEY_CTRL	0x01
 #define KEY_SHIFT	0x02
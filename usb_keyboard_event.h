@@ -1,16 +1,30 @@
-// Converts USB key events into modifier bitfield and key list of report structure
+// Queues USB key events and converts them into modifier bitfield and key list
+// of report structure, one report per interrupt-IN slot. System Control and
+// Consumer keys go into their own reports.
 
 #include <stdint.h>
 #include <stdbool.h>
 
-// Calls usb_keyboard_send() if report is dirty
+// If USB is ready, applies as many queued events as can share a report and
+// calls usb_keyboard_send() if report is dirty. Never blocks.
 void usb_keyboard_update( void );
 
 // Marks report as dirty
 void usb_keyboard_touch( void );
 
-// Adjusts report structure to reflect pressed/released key
-void report_usb_event( uint8_t code, bool pressed );
+// Queues key press/release
+void usb_keyboard_event( uint8_t code, bool pressed );
+
+// True if key is pressed in report
+bool usb_keyboard_pressed( uint8_t code );
+
+// Current time in Timer1 ticks. Events are timed from when they're queued,
+// right after the ADB poll that returned them. Implemented by user.
+uint16_t usb_keyboard_time( void );
+
+// Called for each key event once host has taken the report with it, with
+// ticks since it was queued. Implemented by user.
+void usb_keyboard_latency( uint16_t ticks );
 
 
 //// Code
@@ -19,6 +33,7 @@ void report_usb_event( uint8_t code, bool pressed );
 #include "keycode.h"
 #include "config.h"
 #include <stdbool.h>
+#include <string.h>
 
 #ifndef DEBUG
 	#define DEBUG( e )
@@ -28,28 +43,238 @@ static bool usb_report_dirty;
 
 enum { max_keys = 6 };
 
+// Ring of events not yet in report. Entry is key code, with queue_pressed
+// set for press.
+enum { queue_size = 16 }; // must be power of 2
+enum { queue_pressed = 0x100 };
+static uint16_t queue [queue_size];
+static uint16_t queue_time [queue_size];
+static uint8_t queue_head; // next to write
+static uint8_t queue_tail; // next to read
+
+// Queue times of events in keyboard report. The first report_sent are in
+// the report host hasn't taken yet.
+static uint16_t report_times [queue_size];
+static uint8_t report_timed;
+static uint8_t report_sent;
+
+static void report_event( uint8_t code, bool pressed );
+
+#if USB_EXTRA_KEYS
+	enum { extra_system = 1, extra_consumer = 2 };
+	static uint8_t extra_dirty; // reports not yet sent
+	static uint16_t extra_time; // when extra reports last made progress
+	static bool extra_stuck;    // host hasn't taken one since timeout passed
+	
+	// Host without a driver for interface 1 never takes extra reports, so
+	// keyboard reports stop waiting for them after this long
+	enum { extra_timeout = F_CPU / 1024 / 10 }; // 100ms in Timer1 ticks
+	
+	// Finds bit for System Control or Consumer key in its report
+	static uint8_t* extra_bit( uint8_t code, uint8_t* mask )
+	{
+		uint8_t* bits = &system_report_ [1];
+		uint8_t n = code - KC_SYSTEM_POWER;
+		if ( code >= KC_AUDIO_MUTE )
+		{
+			n = code - KC_AUDIO_MUTE;
+			bits = &consumer_report_ [1 + (n >> 3)];
+		}
+		*mask = 1 << (n & 7);
+		return bits;
+	}
+	
+	// Sends one changed report, and returns true if none are left. They share
+	// an endpoint, so only one goes per interrupt-IN slot.
+	static bool extra_flush( void )
+	{
+		if ( extra_dirty && usb_extra_ready() )
+		{
+			extra_time = usb_keyboard_time();
+			extra_stuck = false;
+			if ( extra_dirty & extra_system )
+			{
+				extra_dirty &= ~extra_system;
+				usb_extra_send( system_report_, sizeof system_report_ );
+			}
+			else
+			{
+				extra_dirty = 0;
+				usb_extra_send( consumer_report_, sizeof consumer_report_ );
+			}
+		}
+		
+		return !extra_dirty;
+	}
+#endif
+
 // Marks report as dirty so it'll be sent on the next update
 void usb_keyboard_touch( void )
 {
 	usb_report_dirty = true;
 }
 
-// Calls usb_keyboard_send() only if changes have been made to report via report_usb_event()
+// Adds queued event to report, keeping its time until host takes report
+static void report_queued( uint8_t i )
+{
+	uint8_t code = queue [i];
+	if ( !code )
+		return;
+	
+	report_event( code, queue [i] & queue_pressed );
+	
+	// Extra keys go in other reports
+	bool extra = KC_SYSTEM_POWER <= code && code <= KC_MEDIA_EJECT;
+	if ( !extra && report_timed < queue_size )
+		report_times [report_timed++] = queue_time [i];
+}
+
+// Reports latency of events in report host just took
+static void report_taken( void )
+{
+	if ( !report_sent )
+		return;
+	
+	uint16_t now = usb_keyboard_time();
+	uint8_t n;
+	for ( n = 0; n < report_sent; n++ )
+		usb_keyboard_latency( now - report_times [n] );
+	
+	// Events added since then go in next report
+	report_timed -= report_sent;
+	memmove( report_times, report_times + report_sent, report_timed * sizeof *report_times );
+	report_sent = 0;
+}
+
+static void queue_put( uint16_t e )
+{
+	// When full, oldest event goes into report now. Key state stays right,
+	// though host might not see that transition.
+	if ( (uint8_t) (queue_head - queue_tail) >= queue_size )
+		report_queued( queue_tail++ & (queue_size - 1) );
+	
+	queue_time [queue_head & (queue_size - 1)] = usb_keyboard_time();
+	queue [queue_head++ & (queue_size - 1)] = e;
+}
+
+void usb_keyboard_event( uint8_t code, bool pressed )
+{
+	if ( code )
+		queue_put( pressed ? code | queue_pressed : code );
+}
+
+// True if an event taken since start changed code
+static bool queue_changed( uint8_t start, uint8_t code )
+{
+	for ( ; start != queue_tail; start++ )
+		if ( (uint8_t) queue [start & (queue_size - 1)] == code )
+			return true;
+	
+	return false;
+}
+
+// Calls usb_keyboard_send() only if changes have been made to report by queued events
 void usb_keyboard_update( void )
 {
+	if ( !usb_keyboard_poll() )
+		return;
+	
+	report_taken();
+	
+	#if USB_EXTRA_KEYS
+		// Later events wait, so their changes don't merge with unsent ones,
+		// unless host seems to have stopped taking extra reports
+		if ( !extra_flush() && !extra_stuck )
+		{
+			if ( (uint16_t) (usb_keyboard_time() - extra_time) < extra_timeout )
+				return;
+			
+			// Stays set until a send succeeds, rather than waiting again each
+			// time 16-bit time wraps
+			extra_stuck = true;
+		}
+	#endif
+	
+	// A key can only change once per report, or host would miss a press or
+	// release. Taking events in order until one is for a key already changed
+	// gives the fewest reports that show every change.
+	uint8_t start = queue_tail;
+	while ( queue_head != queue_tail )
+	{
+		uint8_t i = queue_tail & (queue_size - 1);
+		uint8_t code = queue [i];
+		bool pressed = queue [i] & queue_pressed;
+		if ( usb_keyboard_pressed( code ) == pressed )
+			queue [i] = 0; // changes nothing, so doesn't hold back later events for key
+		else if ( queue_changed( start, code ) )
+			break; // goes in next report
+		else
+			report_queued( i );
+		queue_tail++;
+	}
+	
 	if ( usb_report_dirty )
 	{
 		usb_report_dirty = false;
 		usb_keyboard_send();
+		report_sent = report_timed;
 	}
+	
+	#if USB_EXTRA_KEYS
+		extra_flush();
+	#endif
+}
+
+bool usb_keyboard_pressed( uint8_t code )
+{
+	if ( KC_LCTRL <= code && code <= KC_RGUI )
+		return keyboard_modifier_keys >> (code - KC_LCTRL) & 1;
+	
+	if ( KC_SYSTEM_POWER <= code && code <= KC_MEDIA_EJECT )
+	{
+		#if USB_EXTRA_KEYS
+			uint8_t mask;
+			return (*extra_bit( code, &mask ) & mask) != 0;
+		#else
+			return false;
+		#endif
+	}
+	
+	#if USB_NKRO
+		if ( code <= nkro_max_code )
+			return code && (keyboard_nkro_keys [code >> 3] >> (code & 7) & 1);
+	#endif
+	
+	uint8_t n;
+	for ( n = 0; n < max_keys; n++ )
+		if ( keyboard_keys [n] == code )
+			return code != 0;
+	
+	return false;
 }
 
 // Adds key press/release to current report
-void usb_keyboard_event( uint8_t code, bool pressed )
+static void report_event( uint8_t code, bool pressed )
 {
 	if ( !code )
 		return;
 	
+	if ( KC_SYSTEM_POWER <= code && code <= KC_MEDIA_EJECT )
+	{
+		// Not in keyboard report. Ignored unless USB_EXTRA_KEYS.
+		#if USB_EXTRA_KEYS
+			uint8_t mask;
+			uint8_t* bits = extra_bit( code, &mask );
+			*bits |= mask;
+			if ( !pressed )
+				*bits ^= mask;
+			if ( !extra_dirty )
+				extra_time = usb_keyboard_time();
+			extra_dirty |= (code >= KC_AUDIO_MUTE) ? extra_consumer : extra_system;
+		#endif
+		return;
+	}
+	
 	usb_report_dirty = true;
 	
 	if ( KC_LCTRL <= code && code <= KC_RGUI )
@@ -62,6 +287,19 @@ void usb_keyboard_event( uint8_t code, bool pressed )
 	}
 	else
 	{
+		#if USB_NKRO
+			// Kept in bitmap as well as boot report's list, which might not
+			// have room for it
+			if ( code <= nkro_max_code )
+			{
+				uint8_t* bits = &keyboard_nkro_keys [code >> 3];
+				uint8_t mask = 1 << (code & 7);
+				*bits |= mask;
+				if ( !pressed )
+					*bits ^= mask;
+			}
+		#endif
+		
 		// Find key
 		uint8_t* p = keyboard_keys + max_keys;
 		do
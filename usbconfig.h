@@ -10,6 +10,8 @@
 #ifndef __usbconfig_h_included__
 #define __usbconfig_h_included__
 
+#include "config.h" /* for ADB_MOUSE and USB_EXTRA_KEYS */
+
 /*
 General Description:
 This file is an example configuration (with inline documentation) for the USB
@@ -79,7 +81,11 @@ section at the end of this file).
  * default control endpoint 0 and an interrupt-in endpoint (any other endpoint
  * number).
  */
+#if ADB_MOUSE || USB_EXTRA_KEYS
+#define USB_CFG_HAVE_INTRIN_ENDPOINT3   1
+#else
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
+#endif
 /* Define this to 1 if you want to compile a version with three endpoints: The
  * default control endpoint 0, an interrupt-in endpoint 3 (or the number
  * configured below) and a catch-all default interrupt-in endpoint as above.
@@ -114,9 +120,15 @@ section at the end of this file).
  * interval. The value is in milliseconds and must not be less than 10 ms for
  * low speed devices.
  */
-#define USB_CFG_IS_SELF_POWERED         0
+#ifndef __ASSEMBLER__
+extern unsigned char usb_device_status;
+#endif
+#define USB_CFG_IS_SELF_POWERED         (usb_device_status)
 /* Define this to 1 if the device has its own power supply. Set it to 0 if the
  * device is powered from the USB bus.
+ * We're bus-powered, but V-USB answers GET_STATUS with this, so it's the whole
+ * device status, including the remote wakeup bit. See usb_keyboard.c. Our own
+ * configuration descriptor gives the power attributes.
  */
 #define USB_CFG_MAX_BUS_POWER           100
 /* Set this variable to the maximum USB bus power consumption of your device.
@@ -134,7 +146,12 @@ section at the end of this file).
  * data from a static buffer, set it to 0 and return the data from
  * usbFunctionSetup(). This saves a couple of bytes.
  */
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
 #define USB_CFG_IMPLEMENT_FN_WRITEOUT   0
+#else
+/* interrupt-out endpoint 1 for LEDs, see usb_keyboard.c */
+#define USB_CFG_IMPLEMENT_FN_WRITEOUT   1
+#endif
 /* Define this to 1 if you want to use interrupt-out (or bulk out) endpoints.
  * You must implement the function usbFunctionWriteOut() which receives all
  * interrupt/bulk data sent to any endpoint other than 0. The endpoint number
@@ -155,7 +172,11 @@ section at the end of this file).
  * in a single control-in or control-out transfer. Note that the capability
  * for long transfers increases the driver size.
  */
-/* #define USB_RX_USER_HOOK(data, len)     if(usbRxToken == (uchar)USBPID_SETUP) blinkLED(); */
+#define USB_RX_USER_HOOK(data, len) \
+	if(usbRxToken == (uchar)USBPID_SETUP) {\
+		void hadUsbSetup( uchar const* );\
+		hadUsbSetup( data );\
+	}
 /* This macro is a hook if you want to do unconventional things. If it is
  * defined, it's inserted at the beginning of received message processing.
  * If you eat the received message and don't want default processing to
@@ -280,7 +301,11 @@ section at the end of this file).
 /* See USB specification if you want to conform to an existing device class or
  * protocol.
  */
+#if USB_NKRO
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    57   /* N-key rollover, see usb_keyboard.c */
+#else
 #define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    63   /* total length of report descriptor */
+#endif
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  */
@@ -338,14 +363,20 @@ section at the end of this file).
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
-#define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+/* keyboard, and mouse and/or extra keys interfaces, see usb_keyboard.c */
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           (9 + (1 + USB_CFG_HAVE_INTRIN_ENDPOINT3) * (9 + 9 + 7) + 7 * USB_CFG_IMPLEMENT_FN_WRITEOUT)
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
 #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#if ADB_MOUSE || USB_EXTRA_KEYS
+#define USB_CFG_DESCR_PROPS_HID                     USB_PROP_IS_DYNAMIC
+#define USB_CFG_DESCR_PROPS_HID_REPORT              USB_PROP_IS_DYNAMIC
+#else
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
+#endif
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
 
 
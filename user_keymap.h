@@ -1,8 +1,10 @@
-// Modify as desired
+// Modify as desired. More layers can follow the first (up to 4), using
+// KC_TRNS for keys that stay the same and KC_MOn/KC_TGn/KC_DFn to switch to
+// them. See keymap.h.
 
 static const uint8_t PROGMEM keymap_extended [] [128] = {
 	KEYMAP_EXTENDED_US(
-	ESC, F1,  F2,  F3,  F4,  F5,  F6,  F7,  F8,  F9,  F10, F11, F12,           PSCR,SLCK,PAUS,                   NO,
+	ESC, F1,  F2,  F3,  F4,  F5,  F6,  F7,  F8,  F9,  F10, F11, F12,           PSCR,SLCK,PAUS,                   PWR,
 	GRV, 1,   2,   3,   4,   5,   6,   7,   8,   9,   0,   MINS,EQL, BSPC,     INS, HOME,PGUP,    NLCK,PEQL,PSLS,PAST,
 	TAB, Q,   W,   E,   R,   T,   Y,   U,   I,   O,   P,   LBRC,RBRC,BSLS,     DEL, END, PGDN,    P7,  P8,  P9,  PMNS,
 	CAPS,A,   S,   D,   F,   G,   H,   J,   K,   L,   SCLN,QUOT,     ENT,                         P4,  P5,  P6,  PPLS,
@@ -17,7 +19,7 @@ static const uint8_t PROGMEM keymap_extended [] [128] = {
 
 static const uint8_t PROGMEM keymap_compact [] [128] = {
 	KEYMAP_M0116(
-		                     NO,
+		                     PWR,
 	ESC, 1,   2,   3,   4,   5,   6,   7,   8,   9,   0,   MINS,EQL, BSPC,     NLCK,PEQL,PSLS,PAST,
 	TAB, Q,   W,   E,   R,   T,   Y,   U,   I,   O,   P,   LBRC,RBRC,          P7,  P8,  P9,  PMNS,
 	LCTL,A,   S,   D,   F,   G,   H,   J,   K,   L,   SCLN,QUOT,     ENT,      P4,  P5,  P6,  PPLS,
@@ -29,3 +31,8 @@ static const uint8_t PROGMEM keymap_compact [] [128] = {
 #endif
 	),
 };
+
+// Sound buttons of Adjustable Keyboard: mic, mute, volume down, volume up
+static const uint8_t PROGMEM keymap_appliance [4] = {
+	KC_NO, KC_MUTE, KC_VOLD, KC_VOLU
+};